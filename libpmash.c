@@ -0,0 +1,226 @@
+/******************************************************************************
+ * Copyright (C) 2018-2020 David Boyce
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more detail.
+ *
+ * You may have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * LD_PRELOAD interposer backend for pmash. When injected into the
+ * audited command (pmash -E preload does this automatically) it
+ * intercepts the open-family calls and streams one "R <path>" or
+ * "W <path>" line per access to the parent pmash over the pipe whose
+ * write end is named by $PMASH_FD. The parent then needs no pre-scan,
+ * no post-scan and no atime support at all: per-recipe cost is
+ * proportional to the files actually touched rather than the files in
+ * the tree. Lines stay under PIPE_BUF so concurrent children within
+ * the recipe can share the pipe without interleaving.
+ *
+ * The stat family is deliberately not intercepted: merely stat-ing a
+ * file never makes it a prerequisite under the atime semantics the
+ * other engines implement, so reporting those calls would only add
+ * noise for the parent to discard.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int outfd = -1;
+
+static void __attribute__((constructor))
+pmash_preload_init(void)
+{
+    const char *fdstr = getenv("PMASH_FD");
+
+    if (fdstr) {
+        outfd = atoi(fdstr);
+    }
+}
+
+static void
+report(char tag, const char *path)
+{
+    char buf[PATH_MAX + 8];
+    int len;
+
+    if (outfd == -1 || !path) {
+        return;
+    }
+    len = snprintf(buf, sizeof(buf), "%c %s\n", tag, path);
+    if (len > 0 && len < (int)sizeof(buf)) {
+        (void)!write(outfd, buf, len);
+    }
+}
+
+// Resolve a dirfd-relative path via /proc so openat() reports the same
+// shape of path as plain open().
+static void
+report_at(char tag, int dirfd, const char *path)
+{
+    char lnk[64], buf[PATH_MAX], full[PATH_MAX * 2];
+    ssize_t len;
+
+    if (!path || path[0] == '/' || dirfd == AT_FDCWD) {
+        report(tag, path);
+        return;
+    }
+    snprintf(lnk, sizeof(lnk), "/proc/self/fd/%d", dirfd);
+    if ((len = readlink(lnk, buf, sizeof(buf) - 1)) == -1) {
+        return;
+    }
+    buf[len] = '\0';
+    snprintf(full, sizeof(full), "%s/%s", buf, path);
+    report(tag, full);
+}
+
+static char
+open_tag(int flags)
+{
+    return (flags & (O_WRONLY|O_RDWR)) ? 'W' : 'R';
+}
+
+int
+open(const char *path, int flags, ...)
+{
+    static int (*real)(const char *, int, ...);
+    mode_t mode = 0;
+
+    if (!real) {
+        real = dlsym(RTLD_NEXT, "open");
+    }
+    if (flags & O_CREAT) {
+        va_list ap;
+
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    report(open_tag(flags), path);
+    return real(path, flags, mode);
+}
+
+int
+open64(const char *path, int flags, ...)
+{
+    static int (*real)(const char *, int, ...);
+    mode_t mode = 0;
+
+    if (!real) {
+        real = dlsym(RTLD_NEXT, "open64");
+    }
+    if (flags & O_CREAT) {
+        va_list ap;
+
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    report(open_tag(flags), path);
+    return real(path, flags, mode);
+}
+
+int
+openat(int dirfd, const char *path, int flags, ...)
+{
+    static int (*real)(int, const char *, int, ...);
+    mode_t mode = 0;
+
+    if (!real) {
+        real = dlsym(RTLD_NEXT, "openat");
+    }
+    if (flags & O_CREAT) {
+        va_list ap;
+
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    report_at(open_tag(flags), dirfd, path);
+    return real(dirfd, path, flags, mode);
+}
+
+int
+openat64(int dirfd, const char *path, int flags, ...)
+{
+    static int (*real)(int, const char *, int, ...);
+    mode_t mode = 0;
+
+    if (!real) {
+        real = dlsym(RTLD_NEXT, "openat64");
+    }
+    if (flags & O_CREAT) {
+        va_list ap;
+
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    report_at(open_tag(flags), dirfd, path);
+    return real(dirfd, path, flags, mode);
+}
+
+int
+creat(const char *path, mode_t mode)
+{
+    static int (*real)(const char *, mode_t);
+
+    if (!real) {
+        real = dlsym(RTLD_NEXT, "creat");
+    }
+    report('W', path);
+    return real(path, mode);
+}
+
+FILE *
+fopen(const char *path, const char *mode)
+{
+    static FILE *(*real)(const char *, const char *);
+
+    if (!real) {
+        real = dlsym(RTLD_NEXT, "fopen");
+    }
+    // "r+" and friends both read and write; report both sides.
+    if (strchr(mode, '+')) {
+        report('R', path);
+        report('W', path);
+    } else {
+        report(mode[0] == 'r' ? 'R' : 'W', path);
+    }
+    return real(path, mode);
+}
+
+FILE *
+fopen64(const char *path, const char *mode)
+{
+    static FILE *(*real)(const char *, const char *);
+
+    if (!real) {
+        real = dlsym(RTLD_NEXT, "fopen64");
+    }
+    if (strchr(mode, '+')) {
+        report('R', path);
+        report('W', path);
+    } else {
+        report(mode[0] == 'r' ? 'R' : 'W', path);
+    }
+    return real(path, mode);
+}
+
+// vim: ts=8:sw=4:tw=80:et:
@@ -0,0 +1,198 @@
+/******************************************************************************
+ * Copyright (C) 2018-2020 David Boyce
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more detail.
+ *
+ * You may have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * Native scan engine for the Python pmaudit front end. The two tree
+ * traversals - the priming pre-scan and the classifying post-scan -
+ * are where pmaudit spends nearly all its time, in interpreter-speed
+ * os.walk loops with one os.utime call per file. This library does the
+ * same walk in C and hands back a flat (path, atime, mtime, size)
+ * list; classification and all output formatting stay in Python where
+ * they cost nothing and flexibility matters.
+ *
+ * The semantics deliberately mirror pmaudit's Python loops, not
+ * pmash's: priming sets atime to mtime minus a full day (pmaudit's
+ * roundoff margin) and only when atime >= mtime; the pre-scan skips
+ * symlinks while the post-scan lstats them; excluded basenames prune
+ * both files and whole directories. Being a plain library it reports
+ * failure by return value rather than exiting.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libpmaudit.h"
+
+// Same margin as pmaudit's DELTA: anything >1s dodges roundoff.
+#define PMAUDIT_DELTA (24 * 60 * 60)
+
+typedef struct {
+    pmaudit_ent_s *ents;
+    size_t n, cap;
+    const char *excludes;
+    int prime;
+} scan_s;
+
+static int
+excluded_name(const char *excludes, const char *name)
+{
+    const char *p = excludes;
+    size_t len = strlen(name);
+
+    while (p && *p) {
+        const char *end = strchr(p, ',');
+        size_t l = end ? (size_t)(end - p) : strlen(p);
+
+        if (l == len && !strncmp(p, name, len)) {
+            return 1;
+        }
+        p = end ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+static double
+tsfloat(const struct timespec *ts)
+{
+    return (double)ts->tv_sec + (double)ts->tv_nsec / 1e9;
+}
+
+static int
+scan_add(scan_s *ss, const char *path, const struct stat *st)
+{
+    pmaudit_ent_s *e;
+
+    if (ss->n == ss->cap) {
+        pmaudit_ent_s *grown;
+
+        ss->cap = ss->cap ? ss->cap * 2 : 1024;
+        if ((grown = realloc(ss->ents, ss->cap * sizeof(*grown))) == NULL) {
+            return -1;
+        }
+        ss->ents = grown;
+    }
+    e = &ss->ents[ss->n];
+    if ((e->path = strdup(path)) == NULL) {
+        return -1;
+    }
+    e->atime = tsfloat(&st->st_atim);
+    e->mtime = tsfloat(&st->st_mtim);
+    e->size = (long long)st->st_size;
+    ss->n++;
+    return 0;
+}
+
+static int
+scan_dir(scan_s *ss, const char *dir)
+{
+    DIR *d;
+    struct dirent *de;
+    int rc = 0;
+
+    if ((d = opendir(dir)) == NULL) {
+        // Mirror the Python walkers: unreadable dirs are skipped.
+        return 0;
+    }
+    while (rc == 0 && (de = readdir(d))) {
+        char *path;
+        struct stat st;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        if (excluded_name(ss->excludes, de->d_name)) {
+            continue;
+        }
+        if (!strcmp(dir, ".")) {
+            if (asprintf(&path, "%s", de->d_name) == -1) {
+                rc = -1;
+                break;
+            }
+        } else if (asprintf(&path, "%s/%s", dir, de->d_name) == -1) {
+            rc = -1;
+            break;
+        }
+        if (lstat(path, &st) == -1) {
+            free(path);
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            rc = scan_dir(ss, path);
+        } else if (ss->prime) {
+            // Pre-scan: regular files only, atime primed behind mtime
+            // so relatime will register the next read.
+            if (S_ISREG(st.st_mode)) {
+                if (st.st_atim.tv_sec >= st.st_mtim.tv_sec) {
+                    struct timespec times[2];
+
+                    times[0] = st.st_mtim;
+                    times[0].tv_sec -= PMAUDIT_DELTA;
+                    times[1] = st.st_mtim;
+                    if (utimensat(AT_FDCWD, path, times, 0) == 0) {
+                        st.st_atim = times[0];
+                    }
+                }
+                rc = scan_add(ss, path, &st);
+            }
+        } else {
+            // Post-scan: everything that isn't a directory, links
+            // included, exactly as the Python visit callback lstats.
+            rc = scan_add(ss, path, &st);
+        }
+        free(path);
+    }
+    (void)closedir(d);
+    return rc;
+}
+
+int
+pmaudit_scan(const char *watchdir, const char *excludes, int prime,
+        pmaudit_ent_s **ents, size_t *nents)
+{
+    scan_s ss;
+
+    memset(&ss, 0, sizeof(ss));
+    ss.excludes = excludes ? excludes : "";
+    ss.prime = prime;
+    if (scan_dir(&ss, watchdir) == -1) {
+        pmaudit_free(ss.ents, ss.n);
+        return -1;
+    }
+    *ents = ss.ents;
+    *nents = ss.n;
+    return 0;
+}
+
+void
+pmaudit_free(pmaudit_ent_s *ents, size_t nents)
+{
+    size_t i;
+
+    for (i = 0; i < nents; i++) {
+        free(ents[i].path);
+    }
+    free(ents);
+}
+
+// vim: ts=8:sw=4:tw=80:et:
@@ -0,0 +1,37 @@
+/******************************************************************************
+ * Copyright (C) 2018-2020 David Boyce
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more detail.
+ *
+ * You may have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef LIBPMAUDIT_H
+#define LIBPMAUDIT_H
+
+#include <stddef.h>
+
+// One scanned file: path relative to the cwd plus the times and size
+// pmaudit's classification needs.
+typedef struct {
+    char *path;
+    double atime;
+    double mtime;
+    long long size;
+} pmaudit_ent_s;
+
+int pmaudit_scan(const char *watchdir, const char *excludes, int prime,
+        pmaudit_ent_s **ents, size_t *nents);
+void pmaudit_free(pmaudit_ent_s *ents, size_t nents);
+
+#endif
+
+// vim: ts=8:sw=4:tw=80:et:
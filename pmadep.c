@@ -0,0 +1,234 @@
+/******************************************************************************
+ * Copyright (C) 2018-2020 David Boyce
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more detail.
+ *
+ * You may have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * Companion tool for the pmash shared dependency database (pmash -D).
+ * The database is an append-only log of audit records - a "T <target>"
+ * line, "P <prereq>" lines, a blank terminator - serialized by flock
+ * on the writing side. pmadep reads the whole log in one sequential
+ * pass and emits make-format dependency output for every target on
+ * stdout, so make can include a single generated file instead of
+ * re-opening tens of thousands of tiny .d files on each incremental
+ * build. A target re-audited later in the log supersedes its earlier
+ * records.
+ *
+ * Typical use:
+ *
+ *     pmadep -f pmash.db > deps.mk
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+
+static char short_opts[] = "f:h";
+static struct option long_opts[] = {
+   {"dbfile", required_argument, NULL, 'f'},
+   {"help", no_argument, NULL, 'h'},
+   {NULL, 0, NULL, 0}
+};
+
+static const char *prog = "??";
+
+typedef struct record {
+    char *target;
+    uint64_t hash;
+    char **prereqs;
+    size_t nprereqs, cap;
+    struct record *super;       /* later record for the same target */
+} record_s;
+
+static record_s **records;
+static size_t nrecords, reccap;
+
+// Hash index over target names: the slot for each target holds its
+// latest record, so a re-audited target supersedes the previous one in
+// O(1) and replaying a full build's log stays a single linear pass.
+static struct {
+    record_s **slots;
+    size_t cap, cnt;
+} tgttab;
+
+static uint64_t
+strhash(const char *s)
+{
+    uint64_t h = 14695981039346656037UL;
+
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 1099511628211UL;
+    }
+    return h;
+}
+
+static void
+usage(int rc)
+{
+    FILE *f = (rc == EXIT_SUCCESS) ? stdout : stderr;
+    const char *fmt = "   %-18s %s\n";
+
+    fprintf(f, "Usage: %s [-f <dbfile>]\n", prog);
+    fprintf(f, fmt, "-h/--help", "Print this usage summary");
+    fprintf(f, fmt, "-f/--dbfile", "Deps database to read (default=pmash.db)");
+    exit(rc);
+}
+
+static void
+insist(int success, const char *term)
+{
+    if (!success) {
+        fprintf(stderr, "%s: Error: %s: %s\n", prog, term, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static record_s *
+record_new(const char *target)
+{
+    record_s *r;
+    size_t i;
+
+    insist((r = calloc(1, sizeof(record_s))) != NULL, "calloc()");
+    insist((r->target = strdup(target)) != NULL, "strdup()");
+    r->hash = strhash(target);
+    if (tgttab.cnt * 10 >= tgttab.cap * 7) {
+        record_s **old = tgttab.slots;
+        size_t ocap = tgttab.cap;
+
+        tgttab.cap = tgttab.cap ? tgttab.cap * 2 : 1024;
+        insist((tgttab.slots = calloc(tgttab.cap, sizeof(record_s *)))
+                != NULL, "calloc()");
+        for (i = 0; i < ocap; i++) {
+            if (old[i]) {
+                size_t j;
+
+                for (j = old[i]->hash & (tgttab.cap - 1); tgttab.slots[j];
+                        j = (j + 1) & (tgttab.cap - 1)) {
+                }
+                tgttab.slots[j] = old[i];
+            }
+        }
+        free(old);
+    }
+    // Mark the earlier record for the same target as superseded and
+    // take over its slot; still-older ones were marked on their way out.
+    for (i = r->hash & (tgttab.cap - 1); tgttab.slots[i];
+            i = (i + 1) & (tgttab.cap - 1)) {
+        if (tgttab.slots[i]->hash == r->hash &&
+                !strcmp(tgttab.slots[i]->target, target)) {
+            tgttab.slots[i]->super = r;
+            break;
+        }
+    }
+    if (!tgttab.slots[i]) {
+        tgttab.cnt++;
+    }
+    tgttab.slots[i] = r;
+    if (nrecords == reccap) {
+        reccap = reccap ? reccap * 2 : 1024;
+        insist((records = realloc(records, reccap * sizeof(record_s *)))
+                != NULL, "realloc()");
+    }
+    records[nrecords++] = r;
+    return r;
+}
+
+static void
+record_prereq(record_s *r, const char *path)
+{
+    if (r->nprereqs == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 16;
+        insist((r->prereqs = realloc(r->prereqs, r->cap * sizeof(char *)))
+                != NULL, "realloc()");
+    }
+    insist((r->prereqs[r->nprereqs++] = strdup(path)) != NULL, "strdup()");
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *dbfile = "pmash.db";
+    char *line = NULL;
+    size_t i, j, linesz = 0;
+    ssize_t len;
+    record_s *cur = NULL;
+    FILE *db;
+
+    prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+
+    while (1) {
+        int c;
+
+        c = getopt_long(argc, argv, short_opts, long_opts, NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'h':
+                usage(EXIT_SUCCESS);
+                break;
+            case 'f':
+                dbfile = optarg;
+                break;
+            default:
+                usage(EXIT_FAILURE);
+        }
+    }
+
+    insist((db = fopen(dbfile, "r")) != NULL, dbfile);
+    // A shared lock keeps a concurrent appender's record whole.
+    insist(flock(fileno(db), LOCK_SH) != -1, dbfile);
+
+    while ((len = getline(&line, &linesz, db)) > 0) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == 'T' && line[1] == ' ') {
+            cur = record_new(line + 2);
+        } else if (line[0] == 'P' && line[1] == ' ' && cur) {
+            record_prereq(cur, line + 2);
+        } else if (!line[0]) {
+            cur = NULL;
+        }
+    }
+    free(line);
+    fclose(db);
+
+    for (i = 0; i < nrecords; i++) {
+        record_s *r = records[i];
+
+        if (r->super) {
+            continue;
+        }
+        printf("%s:", r->target);
+        for (j = 0; j < r->nprereqs; j++) {
+            printf(" \\\n  %s", r->prereqs[j]);
+        }
+        printf("\n");
+        for (j = 0; j < r->nprereqs; j++) {
+            printf("\n%s:\n", r->prereqs[j]);
+        }
+        printf("\n");
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=8:sw=4:tw=80:et:
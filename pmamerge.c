@@ -0,0 +1,490 @@
+/******************************************************************************
+ * Copyright (C) 2018-2020 David Boyce
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more detail.
+ *
+ * You may have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * pmamerge - merge sharded audit output into one dependency map. A big
+ * product split across build nodes leaves one audit artifact per
+ * shard: make-format .d files from pmash -d, shared deps-database logs
+ * from pmash -D, or JSON databases from pmash -j / pmaudit. pmamerge
+ * streams any mix of those, remaps path prefixes that differ between
+ * nodes (-p /node1/ws/=./), deduplicates targets and prereqs through
+ * an interned-string hash index, and emits one combined make-format
+ * dependency stream on stdout.
+ *
+ * The input format is sniffed per file: a '{' opens a JSON database
+ * (its finals and intermediates become targets, each depending on the
+ * full prereq set), a "T " line opens a deps-database log, and
+ * anything else is treated as make format with backslash
+ * continuations. When the same target appears more than once the
+ * later record wins, matching pmadep.
+ *
+ * Typical use:
+ *
+ *     pmamerge -p /b1/ws/=./ -p /b2/ws/=./ node1.db node2.json > deps.mk
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char short_opts[] = "p:h";
+static struct option long_opts[] = {
+   {"prefix", required_argument, NULL, 'p'},
+   {"help", no_argument, NULL, 'h'},
+   {NULL, 0, NULL, 0}
+};
+
+static const char *prog = "??";
+
+#define MAXPREFIXES 64
+static struct {
+    const char *from, *to;
+    size_t fromlen;
+} prefixes[MAXPREFIXES];
+static unsigned nprefixes;
+
+static void
+usage(int rc)
+{
+    FILE *f = (rc == EXIT_SUCCESS) ? stdout : stderr;
+    const char *fmt = "   %-18s %s\n";
+
+    fprintf(f, "Usage: %s [-p OLD=NEW ...] <file> ...\n", prog);
+    fprintf(f, fmt, "-h/--help", "Print this usage summary");
+    fprintf(f, fmt, "-p/--prefix", "Rewrite path prefix OLD to NEW (repeatable)");
+    exit(rc);
+}
+
+static void
+insist(int success, const char *term)
+{
+    if (!success) {
+        fprintf(stderr, "%s: Error: %s: %s\n", prog, term, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Interned-string index. Every path is stored exactly once; a stamp on
+ * the interned entry gives O(1) per-record and per-pass deduplication,
+ * and the entry doubles as the target index by pointing at the latest
+ * record for that path.
+ */
+
+struct record;
+
+typedef struct {
+    char *str;
+    uint64_t hash;
+    size_t stamp;
+    struct record *rec;     /* latest record with this target, if any */
+} intern_s;
+
+static struct {
+    intern_s **slots;
+    size_t cap, cnt;
+} strtab;
+
+static uint64_t
+strhash(const char *s)
+{
+    uint64_t h = 14695981039346656037UL;
+
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 1099511628211UL;
+    }
+    return h;
+}
+
+static intern_s *
+intern(const char *s)
+{
+    uint64_t hash = strhash(s);
+    size_t i;
+
+    if (strtab.cnt * 10 >= strtab.cap * 7) {
+        intern_s **old = strtab.slots;
+        size_t ocap = strtab.cap;
+
+        strtab.cap = strtab.cap ? strtab.cap * 2 : 4096;
+        insist((strtab.slots = calloc(strtab.cap, sizeof(intern_s *)))
+                != NULL, "calloc()");
+        for (i = 0; i < ocap; i++) {
+            if (old[i]) {
+                size_t j;
+
+                for (j = old[i]->hash & (strtab.cap - 1); strtab.slots[j];
+                        j = (j + 1) & (strtab.cap - 1)) {
+                }
+                strtab.slots[j] = old[i];
+            }
+        }
+        free(old);
+    }
+    for (i = hash & (strtab.cap - 1); strtab.slots[i];
+            i = (i + 1) & (strtab.cap - 1)) {
+        if (strtab.slots[i]->hash == hash &&
+                !strcmp(strtab.slots[i]->str, s)) {
+            return strtab.slots[i];
+        }
+    }
+    insist((strtab.slots[i] = calloc(1, sizeof(intern_s))) != NULL,
+            "calloc()");
+    insist((strtab.slots[i]->str = strdup(s)) != NULL, "strdup()");
+    strtab.slots[i]->hash = hash;
+    strtab.cnt++;
+    return strtab.slots[i];
+}
+
+// Apply the first matching prefix remap, then intern.
+static intern_s *
+intern_path(const char *path)
+{
+    unsigned i;
+
+    for (i = 0; i < nprefixes; i++) {
+        if (!strncmp(path, prefixes[i].from, prefixes[i].fromlen)) {
+            char *mapped;
+            intern_s *in;
+
+            insist(asprintf(&mapped, "%s%s", prefixes[i].to,
+                        path + prefixes[i].fromlen) != -1, "asprintf()");
+            in = intern(mapped);
+            free(mapped);
+            return in;
+        }
+    }
+    return intern(path);
+}
+
+typedef struct record {
+    intern_s *target;
+    intern_s **prereqs;
+    size_t nprereqs, cap;
+    size_t seq;             /* dedupe window for this record's prereqs */
+    int superseded;
+} record_s;
+
+static record_s **records;
+static size_t nrecords, reccap, seq;
+
+static record_s *
+record_new(const char *target)
+{
+    record_s *r;
+    intern_s *t = intern_path(target);
+
+    if (t->rec) {
+        t->rec->superseded = 1;
+    }
+    insist((r = calloc(1, sizeof(record_s))) != NULL, "calloc()");
+    r->target = t;
+    r->seq = ++seq;
+    t->rec = r;
+    if (nrecords == reccap) {
+        reccap = reccap ? reccap * 2 : 1024;
+        insist((records = realloc(records, reccap * sizeof(record_s *)))
+                != NULL, "realloc()");
+    }
+    records[nrecords++] = r;
+    return r;
+}
+
+static void
+record_prereq(record_s *r, intern_s *p)
+{
+    if (p->stamp == r->seq || p == r->target) {
+        return;
+    }
+    p->stamp = r->seq;
+    if (r->nprereqs == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 16;
+        insist((r->prereqs = realloc(r->prereqs, r->cap * sizeof(intern_s *)))
+                != NULL, "realloc()");
+    }
+    r->prereqs[r->nprereqs++] = p;
+}
+
+// Deps-database log: "T <target>" / "P <prereq>" / blank terminator.
+static void
+parse_depsdb(FILE *f)
+{
+    char *line = NULL;
+    size_t linesz = 0;
+    record_s *cur = NULL;
+
+    while (getline(&line, &linesz, f) > 0) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == 'T' && line[1] == ' ') {
+            cur = record_new(line + 2);
+        } else if (line[0] == 'P' && line[1] == ' ' && cur) {
+            record_prereq(cur, intern_path(line + 2));
+        } else if (!line[0]) {
+            cur = NULL;
+        }
+    }
+    free(line);
+}
+
+// Make format: logical lines reassembled across backslash
+// continuations, then split at the first colon; "phony:" lines with no
+// prereqs are ignored.
+static void
+parse_make(FILE *f)
+{
+    char *line = NULL, *logical = NULL;
+    size_t linesz = 0, loglen = 0, logcap = 0;
+
+    while (1) {
+        ssize_t len = getline(&line, &linesz, f);
+        int more = 0;
+
+        if (len > 0) {
+            line[strcspn(line, "\n")] = '\0';
+            len = (ssize_t)strlen(line);
+            if (len > 0 && line[len - 1] == '\\') {
+                line[--len] = '\0';
+                more = 1;
+            }
+            if (loglen + len + 2 > logcap) {
+                logcap = (loglen + len + 2) * 2;
+                insist((logical = realloc(logical, logcap)) != NULL,
+                        "realloc()");
+            }
+            if (loglen) {
+                logical[loglen++] = ' ';
+            }
+            memcpy(logical + loglen, line, len + 1);
+            loglen += len;
+        }
+        if (loglen && (!more || len <= 0)) {
+            char *colon = strchr(logical, ':');
+
+            if (colon && colon[1] != '\0') {
+                char *tok, *save;
+                record_s **tgts = NULL;
+                size_t ntgts = 0, tcap = 0, i;
+
+                *colon = '\0';
+                for (tok = strtok_r(logical, " \t", &save); tok;
+                        tok = strtok_r(NULL, " \t", &save)) {
+                    if (ntgts == tcap) {
+                        tcap = tcap ? tcap * 2 : 8;
+                        insist((tgts = realloc(tgts,
+                                    tcap * sizeof(record_s *))) != NULL,
+                                "realloc()");
+                    }
+                    tgts[ntgts++] = record_new(tok);
+                }
+                // A multi-target rule depends every target on the
+                // whole prereq list, not just the last one parsed.
+                for (tok = strtok_r(colon + 1, " \t", &save); tok;
+                        tok = strtok_r(NULL, " \t", &save)) {
+                    for (i = 0; i < ntgts; i++) {
+                        record_prereq(tgts[i], intern_path(tok));
+                    }
+                }
+                free(tgts);
+            }
+            loglen = 0;
+        }
+        if (len <= 0) {
+            break;
+        }
+    }
+    free(line);
+    free(logical);
+}
+
+// JSON audit database in the shape pmash -j and pmaudit emit: the db
+// section's category dicts each open on their own line and keep one
+// file record per line, so a full parser isn't needed. Finals and
+// intermediates become targets of one merged record set depending on
+// every prereq in the shard.
+static void
+parse_json(FILE *f)
+{
+    char *line = NULL;
+    size_t linesz = 0;
+    intern_s **prqs = NULL, **tgts = NULL;
+    size_t nprqs = 0, prqcap = 0, ntgts = 0, tgtcap = 0, i, j;
+    enum { NONE, PRQ, TGT, SKIP } sec = NONE;
+
+    while (getline(&line, &linesz, f) > 0) {
+        char *s = line + strspn(line, " \t");
+        char *end = s + strlen(s);
+
+        while (end > s && (end[-1] == '\n' || end[-1] == ' ')) {
+            *--end = '\0';
+        }
+        if (end > s && end[-1] == '{') {
+            // A dict opens: category dicts select a section, anything
+            // else (root, "db", a nested value) leaves it unset.
+            if (!strncmp(s, "\"prereqs\"", 9)) {
+                sec = PRQ;
+            } else if (!strncmp(s, "\"intermediates\"", 15) ||
+                    !strncmp(s, "\"finals\"", 8)) {
+                sec = TGT;
+            } else if (!strncmp(s, "\"unused\"", 8)) {
+                sec = SKIP;
+            } else {
+                sec = NONE;
+            }
+        } else if (!strcmp(s, "}") || !strcmp(s, "},")) {
+            sec = NONE;
+        } else if ((sec == PRQ || sec == TGT) && s[0] == '"') {
+            char *q = strchr(s + 1, '"');
+
+            if (q) {
+                intern_s *in;
+
+                *q = '\0';
+                in = intern_path(s + 1);
+                if (sec == PRQ) {
+                    if (nprqs == prqcap) {
+                        prqcap = prqcap ? prqcap * 2 : 64;
+                        insist((prqs = realloc(prqs,
+                                prqcap * sizeof(intern_s *))) != NULL,
+                                "realloc()");
+                    }
+                    prqs[nprqs++] = in;
+                } else {
+                    if (ntgts == tgtcap) {
+                        tgtcap = tgtcap ? tgtcap * 2 : 64;
+                        insist((tgts = realloc(tgts,
+                                tgtcap * sizeof(intern_s *))) != NULL,
+                                "realloc()");
+                    }
+                    tgts[ntgts++] = in;
+                }
+            }
+        }
+    }
+    for (i = 0; i < ntgts; i++) {
+        record_s *r = record_new(tgts[i]->str);
+
+        for (j = 0; j < nprqs; j++) {
+            record_prereq(r, prqs[j]);
+        }
+    }
+    free(prqs);
+    free(tgts);
+    free(line);
+}
+
+static void
+parse_file(const char *path)
+{
+    FILE *f;
+    char first[16];
+
+    insist((f = fopen(path, "r")) != NULL, path);
+    if (fgets(first, sizeof(first), f) == NULL) {
+        (void)fclose(f);
+        return;
+    }
+    rewind(f);
+    if (first[0] == '{') {
+        parse_json(f);
+    } else if (first[0] == 'T' && first[1] == ' ') {
+        parse_depsdb(f);
+    } else {
+        parse_make(f);
+    }
+    (void)fclose(f);
+}
+
+int
+main(int argc, char *argv[])
+{
+    size_t i, j;
+
+    prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+
+    while (1) {
+        int c;
+        char *eq;
+
+        c = getopt_long(argc, argv, short_opts, long_opts, NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'h':
+                usage(EXIT_SUCCESS);
+                break;
+            case 'p':
+                if (!(eq = strchr(optarg, '=')) ||
+                        nprefixes >= MAXPREFIXES) {
+                    usage(EXIT_FAILURE);
+                }
+                *eq = '\0';
+                prefixes[nprefixes].from = optarg;
+                prefixes[nprefixes].fromlen = strlen(optarg);
+                prefixes[nprefixes].to = eq + 1;
+                nprefixes++;
+                break;
+            default:
+                usage(EXIT_FAILURE);
+        }
+    }
+
+    if (optind == argc) {
+        usage(EXIT_FAILURE);
+    }
+    for (; optind < argc; optind++) {
+        parse_file(argv[optind]);
+    }
+
+    for (i = 0; i < nrecords; i++) {
+        record_s *r = records[i];
+
+        if (r->superseded || !r->nprereqs) {
+            continue;
+        }
+        printf("%s:", r->target->str);
+        for (j = 0; j < r->nprereqs; j++) {
+            printf(" \\\n  %s", r->prereqs[j]->str);
+        }
+        printf("\n\n");
+    }
+    // One deduplicated phony rule per prereq so deleted files don't
+    // stall make, exactly as the per-recipe .d files do.
+    seq++;
+    for (i = 0; i < nrecords; i++) {
+        record_s *r = records[i];
+
+        if (r->superseded) {
+            continue;
+        }
+        for (j = 0; j < r->nprereqs; j++) {
+            if (r->prereqs[j]->stamp != seq) {
+                r->prereqs[j]->stamp = seq;
+                printf("%s:\n\n", r->prereqs[j]->str);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=8:sw=4:tw=80:et:
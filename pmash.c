@@ -22,241 +22,3492 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <ftw.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <libgen.h>
-#include <search.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/fanotify.h>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define HAVE_URING 1
+#endif
+#endif
 
 #define TMFMT "a1=%010ld.%09ld m1=%010ld.%09ld a2=%010ld.%09ld m2=%010ld.%09ld"
 
-#define NOPENFD 20
+#define MAXWALKERS 64
 
-static char short_opts[] = "c:d:eVW:";
+static char short_opts[] = "c:d:D:eE:j:m:OPs:S:VW:X:";
 static struct option long_opts[] = {
    {"command", required_argument, NULL, 'c'},
    {"depsfile", required_argument, NULL, 'd'},
+   {"depsdb", required_argument, NULL, 'D'},
    {"errexit", no_argument, NULL, 'e'},
+   {"engine", required_argument, NULL, 'E'},
+   {"json", required_argument, NULL, 'j'},
+   {"scope-map", required_argument, NULL, 'm'},
+   {"overlay", no_argument, NULL, 'O'},
+   {"prune-dirs", no_argument, NULL, 'P'},
+   {"snapshot", required_argument, NULL, 's'},
+   {"server", required_argument, NULL, 'S'},
    {"verbose", no_argument, NULL, 'V'},
    {"watch", required_argument, NULL, 'W'},
+   {"exclude", required_argument, NULL, 'X'},
+   {"stats", no_argument, NULL, 1},
+   {"no-probe", no_argument, NULL, 2},
+   {"verify", required_argument, NULL, 3},
+   {"dont-sync", no_argument, NULL, 4},
+   {"restore-times", no_argument, NULL, 5},
+   {"infer-scope", no_argument, NULL, 6},
    {"help", no_argument, NULL, 'h'},
    {NULL, 0, NULL, 0}
 };
 
 static const char *prog = "??";
 
-typedef struct {
-    const char *path;
-    struct timespec times1[2];
-    struct timespec times2[2];
-} pathentry_s;
+extern char **environ;
+
+// Common key prefix shared by every record type the path index holds.
+typedef struct {
+    const char *path;
+    uint64_t hash;
+} pathkey_s;
+
+typedef struct {
+    const char *path;
+    uint64_t hash;
+    uint64_t chash;     /* content fingerprint, 0 unless --verify */
+    uint64_t dev, ino;  /* identity for hardlink/rename tracking */
+    unsigned gen;   /* post-scan generation which last saw this path */
+    struct timespec atime0;     /* pre-audit atime, for --restore-times */
+    struct timespec times1[2];
+    struct timespec times2[2];
+    int64_t size1, size2;
+} pathentry_s;
+
+static FILE *fp;
+static char *depsfile;
+static char *depsdb;
+static char *jsonfile;
+static unsigned verbosity;
+static unsigned prq_count;
+
+static void
+usage(int rc)
+{
+    FILE *f = (rc == EXIT_SUCCESS) ? stdout : stderr;
+    const char *fmt = "   %-18s %s\n";
+
+    fprintf(f, "Usage: %s -c <cmd> [-d <depsfile>] [-W dir[,dir,...]]\n", prog);
+    fprintf(f, fmt, "-h/--help", "Print this usage summary");
+    fprintf(f, fmt, "-c/--command", "Command to invoke");
+    fprintf(f, fmt, "-d/--depsfile", "File path to save dependency list");
+    fprintf(f, fmt, "-D/--depsdb", "Append this audit to a shared deps database");
+    fprintf(f, fmt, "-e/--errexit", "Exit on first error");
+    fprintf(f, fmt, "-E/--engine",
+            "Audit engine: times (default), fanotify, or preload");
+    fprintf(f, fmt, "-j/--json", "File path to save full audit database as JSON");
+    fprintf(f, fmt, "-m/--scope-map", "File mapping target patterns to watch dirs");
+    fprintf(f, fmt, "-O/--overlay", "Run the command in a private overlayfs sandbox");
+    fprintf(f, fmt, "-P/--prune-dirs", "Skip post-scan of dirs with unchanged times (may miss by-path reads)");
+    fprintf(f, fmt, "-s/--snapshot", "Load/save baseline state in this file");
+    fprintf(f, fmt, "-S/--server", "Unix-domain socket of baseline server");
+    fprintf(f, fmt, "-V/--verbose", "Bump verbosity mode");
+    fprintf(f, fmt, "-W/--watch", "Directories to monitor (default='.')");
+    fprintf(f, fmt, "-X/--exclude", "Glob pattern to prune (also .pmashignore)");
+    fprintf(f, fmt, "--stats", "Report per-phase timings and counters");
+    fprintf(f, fmt, "--no-probe", "Trust that atimes work; skip the probe");
+    fprintf(f, fmt, "--verify", "Hash-check files when mtime moved less than this");
+    fprintf(f, fmt, "--dont-sync", "Accept cached attributes on the pre-scan (NFS)");
+    fprintf(f, fmt, "--restore-times", "Put back the atimes of unused files after");
+    fprintf(f, fmt, "--infer-scope",
+            "Narrow the watch scope via map or previous deps");
+    fprintf(f, "\nEXAMPLES:\n\n");
+    fprintf(f, "Compile foo.o leaving prereq data in foo.o.d:\n\n");
+    fprintf(f, "    %s --depsfile=foo.o.d -c 'gcc -c foo.c'\n", prog);
+    fprintf(f, "\nStart a baseline server, then run recipes against it:\n\n");
+    fprintf(f, "    %s -S /tmp/pmash.sock &\n", prog);
+    fprintf(f, "    %s -S /tmp/pmash.sock -d foo.o.d -c 'gcc -c foo.c'\n", prog);
+    exit(rc);
+}
+
+/*
+ * Phase instrumentation. Cheap monotonic timers around the four phases
+ * plus counters on the hot paths, reported as one machine-readable
+ * key=value line on stderr with --stats (or at -VV). Bracketing pmash
+ * with strace to find out that the post-scan dominates gets old fast
+ * when there are thousands of audited recipes per build.
+ */
+
+static struct {
+    double pre_walk, command, post_walk, output;
+    unsigned long files, dirs, pruned, entries, lookups, slot_probes,
+                  utimensats, prime_skips;
+} stats;
+static int show_stats;
+
+// The table and priming hot paths run on the main thread (file entries,
+// unlocked) and on walker threads (dirtab entries, under wq.mtx - which
+// does not exclude the main thread), so their counters are tallied
+// thread-locally and folded into the shared totals once per thread.
+static __thread struct {
+    unsigned long entries, lookups, slot_probes, utimensats, prime_skips;
+} tlstats;
+
+static void
+stats_fold(void)
+{
+    stats.entries += tlstats.entries;
+    stats.lookups += tlstats.lookups;
+    stats.slot_probes += tlstats.slot_probes;
+    stats.utimensats += tlstats.utimensats;
+    stats.prime_skips += tlstats.prime_skips;
+    memset(&tlstats, 0, sizeof(tlstats));
+}
+
+static double
+monotime(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double
+realtime(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_REALTIME, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void
+stats_emit(void)
+{
+    stats_fold();
+    fprintf(stderr, "%s: stats: pre_walk=%.6f command=%.6f post_walk=%.6f "
+            "output=%.6f files=%lu dirs=%lu pruned=%lu entries=%lu "
+            "lookups=%lu slot_probes=%lu utimensat=%lu prime_skips=%lu\n",
+            prog, stats.pre_walk, stats.command, stats.post_walk,
+            stats.output, stats.files, stats.dirs, stats.pruned,
+            stats.entries, stats.lookups, stats.slot_probes,
+            stats.utimensats, stats.prime_skips);
+}
+
+void
+die(char *msg)
+{
+    fprintf(stderr, "%s: Error: %s\n", prog, msg);
+    exit(EXIT_FAILURE);
+}
+
+void
+insist(int success, const char *term)
+{
+    if (!success) {
+        fprintf(stderr, "%s: Error: %s: %s\n", prog, term, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Arena allocator. A million-file tree used to cost a calloc plus a
+ * strdup per file per phase, fragmenting the heap and scattering
+ * entries all over memory. Instead, entry records and their path
+ * strings are bump-allocated from large mmap'd slabs which are never
+ * individually freed: the baseline (tree1) lives in a permanent arena
+ * for the life of the process while per-recipe state (tree2 etc) comes
+ * from a scratch arena released wholesale after each audit. Fresh
+ * slabs are zero-filled by mmap so no memset is needed.
+ */
+
+#define ARENA_SLAB (16 * 1024 * 1024)
+
+typedef struct slab {
+    struct slab *next;
+    size_t used, size;
+    char mem[];
+} slab_s;
+
+typedef struct {
+    slab_s *slabs;
+} arena_s;
+
+static arena_s perm_arena, scratch_arena;
+
+static void *
+arena_bump(arena_s *a, size_t len, size_t align)
+{
+    slab_s *s = a->slabs;
+    size_t off;
+
+    off = s ? (s->used + align - 1) & ~(align - 1) : 0;
+    if (!s || off + len > s->size) {
+        size_t sz = ARENA_SLAB;
+
+        if (len + sizeof(slab_s) > sz) {
+            sz = len + sizeof(slab_s);
+        }
+        insist((s = mmap(NULL, sz, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) != MAP_FAILED,
+                "mmap(arena)");
+        s->next = a->slabs;
+        s->size = sz - sizeof(slab_s);
+        a->slabs = s;
+        off = 0;
+    }
+    s->used = off + len;
+    return s->mem + off;
+}
+
+static void *
+arena_alloc(arena_s *a, size_t len)
+{
+    return arena_bump(a, len, 16);
+}
+
+static char *
+arena_strdup(arena_s *a, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *p = arena_bump(a, len, 1);
+
+    memcpy(p, str, len);
+    return p;
+}
+
+static void
+arena_reset(arena_s *a)
+{
+    slab_s *s, *next;
+
+    for (s = a->slabs; s; s = next) {
+        next = s->next;
+        (void)munmap(s, sizeof(slab_s) + s->size);
+    }
+    a->slabs = NULL;
+}
+
+/*
+ * Path index: an open-addressing hash table with linear probing.
+ * The old tsearch red-black trees cost O(log n) full strcmps per
+ * lookup, each a random pointer chase; with precomputed hashes a probe
+ * here usually touches one or two cache lines and compares one string.
+ * Records only need to start with a pathkey_s. Entries are never
+ * deleted; tables grow at 70% load.
+ */
+
+typedef struct {
+    void **slots;
+    size_t cap;     /* always a power of two */
+    size_t cnt;
+} pathtab_s;
+
+static pathtab_s tab1;      /* baseline state, diffed in place */
+static pathtab_s newtab;    /* files which appeared during the command */
+static unsigned scan_gen;   /* current post-scan generation */
+
+static uint64_t
+pathhash(const char *s)
+{
+    uint64_t h = 14695981039346656037UL;    /* FNV-1a */
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static void *
+tab_find(pathtab_s *t, const char *path, uint64_t hash)
+{
+    size_t i;
+
+    tlstats.lookups++;
+    if (!t->cap) {
+        return NULL;
+    }
+    for (i = hash & (t->cap - 1); t->slots[i]; i = (i + 1) & (t->cap - 1)) {
+        pathkey_s *k = t->slots[i];
+
+        tlstats.slot_probes++;
+
+        if (k->hash == hash && !strcmp(k->path, path)) {
+            return k;
+        }
+    }
+    return NULL;
+}
+
+static void
+tab_insert(pathtab_s *t, void *ep)
+{
+    pathkey_s *k = ep;
+    size_t i;
+
+    if (t->cnt * 10 >= t->cap * 7) {
+        void **oslots = t->slots;
+        size_t ocap = t->cap;
+
+        t->cap = ocap ? ocap * 2 : 1024;
+        insist((t->slots = calloc(t->cap, sizeof(void *))) != NULL,
+                "calloc(pathtab)");
+        for (i = 0; i < ocap; i++) {
+            pathkey_s *ok = oslots[i];
+            size_t j;
+
+            if (!ok) {
+                continue;
+            }
+            for (j = ok->hash & (t->cap - 1); t->slots[j];
+                    j = (j + 1) & (t->cap - 1)) {
+            }
+            t->slots[j] = ok;
+        }
+        free(oslots);
+    }
+    for (i = k->hash & (t->cap - 1); t->slots[i]; i = (i + 1) & (t->cap - 1)) {
+    }
+    t->slots[i] = k;
+    t->cnt++;
+    tlstats.entries++;
+}
+
+static void
+tab_reset(pathtab_s *t)
+{
+    free(t->slots);
+    t->slots = NULL;
+    t->cap = t->cnt = 0;
+}
+
+static int
+pathcmp(const void *pa, const void *pb)
+{
+    return strcmp((*(pathkey_s **)pa)->path, (*(pathkey_s **)pb)->path);
+}
+
+/*
+ * Exclusion patterns. The old behavior ran three strstr scans per
+ * visited path and still descended into excluded trees, so a .git
+ * directory full of objects got walked and stat'd every run. Patterns
+ * (built-in defaults, -X/--exclude, and a .pmashignore file of one
+ * glob per line) are collected once up front and applied per directory
+ * entry before the stat, so an excluded directory is pruned without
+ * ever being descended into. Patterns containing a slash match the
+ * whole relative path, others match the basename.
+ */
+
+static char **excludes;
+static unsigned nexcludes;
+
+static void
+exclude_add(const char *pattern)
+{
+    if (!(nexcludes & (nexcludes + 1))) {
+        insist((excludes = realloc(excludes,
+                        (nexcludes + 1) * 2 * sizeof(char *))) != NULL,
+                "realloc(excludes)");
+    }
+    excludes[nexcludes++] = strdup(pattern);
+}
+
+static void
+exclude_load(void)
+{
+    FILE *f;
+
+    exclude_add(".git");
+    exclude_add(".svn");
+    exclude_add("*.swp");
+    if ((f = fopen(".pmashignore", "r"))) {
+        char line[PATH_MAX];
+
+        while (fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "#\n")] = '\0';
+            if (line[0]) {
+                exclude_add(line);
+            }
+        }
+        fclose(f);
+    }
+}
+
+static int
+excluded(const char *path)
+{
+    const char *base;
+    unsigned i;
+
+    base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    for (i = 0; i < nexcludes; i++) {
+        if (strchr(excludes[i], '/')) {
+            if (fnmatch(excludes[i], path, FNM_PATHNAME) == 0) {
+                return 1;
+            }
+        } else if (fnmatch(excludes[i], base, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+tscmp(const struct timespec *a, const struct timespec *b)
+{
+    if (a->tv_sec != b->tv_sec) {
+        return a->tv_sec < b->tv_sec ? -1 : 1;
+    }
+    if (a->tv_nsec != b->tv_nsec) {
+        return a->tv_nsec < b->tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+static double
+tsfloat(const struct timespec *ts)
+{
+    return (double)ts->tv_sec + (double)ts->tv_nsec / 1e9;
+}
+
+/*
+ * Content-hash verification (--verify <seconds>). On filesystems with
+ * coarse timestamps a file rewritten within the same tick as its
+ * baseline mtime looks unmodified, which the README calls out as the
+ * one place the timestamp technique breaks down. With --verify the
+ * pre-scan also records a fast FNV-1a fingerprint of each file (first
+ * and last block only, so large files cost at most two reads), and
+ * classification consults it whenever the observed mtime delta is
+ * below the given filesystem resolution: a changed fingerprint or size
+ * promotes the file to a target no matter what the clock says.
+ * Verification is one-directional - it never demotes a file whose
+ * mtime visibly moved - so it can only rescue misclassifications.
+ */
+
+#define VERIFY_BLOCK 4096
+
+static double verify_res;
+
+static uint64_t
+fnv1a(uint64_t h, const unsigned char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ buf[i]) * 1099511628211UL;
+    }
+    return h;
+}
+
+static uint64_t
+content_hash(const char *path, int64_t size)
+{
+    unsigned char buf[VERIFY_BLOCK];
+    uint64_t h = 14695981039346656037UL;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        return 0;
+    }
+    h = fnv1a(h, (unsigned char *)&size, sizeof(size));
+    if ((n = pread(fd, buf, sizeof(buf), 0)) > 0) {
+        h = fnv1a(h, buf, n);
+    }
+    if (size > VERIFY_BLOCK &&
+            (n = pread(fd, buf, sizeof(buf), size - VERIFY_BLOCK)) > 0) {
+        h = fnv1a(h, buf, n);
+    }
+    (void)close(fd);
+    return h ? h : 1;   /* 0 is reserved for "no fingerprint" */
+}
+
+static int
+verify_modified(pathentry_s *p)
+{
+    double delta;
+
+    if (verify_res == 0.0 || !p->chash || p->size1 == -1) {
+        return 0;
+    }
+    delta = tsfloat(&p->times2[1]) - tsfloat(&p->times1[1]);
+    if (delta >= verify_res) {
+        return 0;   /* mtime clearly moved; timestamps suffice */
+    }
+    if (p->size2 != p->size1) {
+        return 1;
+    }
+    return content_hash(p->path, p->size2) != p->chash;
+}
+
+// Record atime/mtime in times1 with atime set behind mtime
+// for "relatime" reasons.
+static void
+prime_times(pathentry_s *p, time_t mtime_sec, long mtime_nsec)
+{
+    p->times1[0].tv_sec = mtime_sec - 1;
+    p->times1[0].tv_nsec = 0L;
+    p->times1[1].tv_sec = mtime_sec;
+    p->times1[1].tv_nsec = mtime_nsec;
+}
+
+// Unconditional priming, for callers who just read the file (the
+// --verify fingerprint): that read moved the atime past whatever the
+// walker observed, so a lazy skip would record a stale baseline and
+// misclassify the file as a prereq on the next audit.
+static void
+prime_hard(pathentry_s *p, const char *fpath, const struct timespec *mtime)
+{
+    prime_times(p, mtime->tv_sec, mtime->tv_nsec);
+    insist(utimensat(AT_FDCWD, fpath, p->times1, 0) != -1, fpath);
+    tlstats.utimensats++;
+}
+
+// Prime lazily: when the observed atime is already behind the mtime
+// the relatime window is open and the metadata write - the most
+// expensive NFS operation in the whole scan - can be skipped, with the
+// observed times recorded as the baseline instead. On a tree pmash
+// audited recently that's nearly every file.
+static void
+prime(pathentry_s *p, const char *fpath, const struct timespec *atime,
+        const struct timespec *mtime)
+{
+    if (tscmp(atime, mtime) < 0) {
+        p->times1[0] = *atime;
+        p->times1[1] = *mtime;
+        tlstats.prime_skips++;
+        return;
+    }
+    prime_hard(p, fpath, mtime);
+}
+
+/*
+ * Inode identity table. Hardlink farms (ccache trees, busybox-style
+ * link forests) present one inode under many paths; timestamps live on
+ * the inode, so only the first path seen needs the priming utimensat
+ * (and the --verify fingerprint read) while later links just inherit
+ * its baseline. The table also gives the diff rename detection: a path
+ * that appears only in the post-scan but whose inode was known before
+ * the command keeps that inode's history - the classic
+ * "mv .deps/x.Tpo .deps/x.Po" pattern - instead of being misread as a
+ * brand-new file.
+ */
+
+typedef struct {
+    uint64_t dev, ino;
+    pathentry_s *owner;
+} inoentry_s;
+
+static struct {
+    inoentry_s *slots;
+    size_t cap, cnt;
+} inotab;
+
+static pathentry_s *
+ino_find(uint64_t dev, uint64_t ino)
+{
+    size_t i;
+
+    if (!inotab.cap || !ino) {
+        return NULL;
+    }
+    for (i = (dev * 31 + ino) & (inotab.cap - 1); inotab.slots[i].owner;
+            i = (i + 1) & (inotab.cap - 1)) {
+        if (inotab.slots[i].dev == dev && inotab.slots[i].ino == ino) {
+            return inotab.slots[i].owner;
+        }
+    }
+    return NULL;
+}
+
+static void
+ino_insert(uint64_t dev, uint64_t ino, pathentry_s *owner)
+{
+    size_t i;
+
+    if (!ino) {
+        return;
+    }
+    if (inotab.cnt * 10 >= inotab.cap * 7) {
+        inoentry_s *old = inotab.slots;
+        size_t ocap = inotab.cap;
+
+        inotab.cap = inotab.cap ? inotab.cap * 2 : 1024;
+        insist((inotab.slots = calloc(inotab.cap, sizeof(inoentry_s)))
+                != NULL, "calloc(inotab)");
+        for (i = 0; i < ocap; i++) {
+            if (old[i].owner) {
+                size_t j;
+
+                for (j = (old[i].dev * 31 + old[i].ino) & (inotab.cap - 1);
+                        inotab.slots[j].owner;
+                        j = (j + 1) & (inotab.cap - 1)) {
+                }
+                inotab.slots[j] = old[i];
+            }
+        }
+        free(old);
+    }
+    for (i = (dev * 31 + ino) & (inotab.cap - 1); inotab.slots[i].owner;
+            i = (i + 1) & (inotab.cap - 1)) {
+    }
+    inotab.slots[i].dev = dev;
+    inotab.slots[i].ino = ino;
+    inotab.slots[i].owner = owner;
+    inotab.cnt++;
+}
+
+static void
+pre_entry(const char *fpath, const struct stat *sb)
+{
+    pathentry_s *p1, *own;
+    uint64_t hash;
+
+    hash = pathhash(fpath);
+    if (tab_find(&tab1, fpath, hash)) {
+        return;     /* overlapping watch dirs */
+    }
+    p1 = arena_alloc(&perm_arena, sizeof(pathentry_s));
+    p1->path = arena_strdup(&perm_arena, fpath);
+    p1->hash = hash;
+    p1->size1 = sb->st_size;
+    p1->dev = sb->st_dev;
+    p1->ino = sb->st_ino;
+    p1->atime0 = sb->st_atim;
+    if ((own = ino_find(p1->dev, p1->ino))) {
+        // Another link to an already-primed inode: inherit its
+        // baseline rather than priming (and hashing) it again.
+        memcpy(p1->times1, own->times1, sizeof(p1->times1));
+        p1->chash = own->chash;
+    } else {
+        if (verify_res != 0.0) {
+            p1->chash = content_hash(fpath, sb->st_size);
+            prime_hard(p1, fpath, &sb->st_mtim);
+        } else {
+            prime(p1, fpath, &sb->st_atim, &sb->st_mtim);
+        }
+        ino_insert(p1->dev, p1->ino, p1);
+    }
+    tab_insert(&tab1, p1);
+}
+
+// The post walk diffs against the baseline record in place: known
+// paths just get their post-times written into the existing entry and
+// stamped with the current generation, so the only allocations left in
+// the post phase are for files which did not exist before the command.
+static void
+post_entry(const char *fpath, const struct stat *sb)
+{
+    pathentry_s *p;
+    uint64_t hash;
+
+    hash = pathhash(fpath);
+    if ((p = tab_find(&tab1, fpath, hash))) {
+        if (p->gen == scan_gen) {
+            return;     /* overlapping watch dirs */
+        }
+    } else if (tab_find(&newtab, fpath, hash)) {
+        return;         /* overlapping watch dirs */
+    } else {
+        pathentry_s *own;
+
+        p = arena_alloc(&scratch_arena, sizeof(pathentry_s));
+        p->path = arena_strdup(&scratch_arena, fpath);
+        p->hash = hash;
+        if ((own = ino_find(sb->st_dev, sb->st_ino))) {
+            // Known inode under a new name: a rename (or new link).
+            // Carry the inode's history so classification sees the
+            // move rather than a brand-new file.
+            memcpy(p->times1, own->times1, sizeof(p->times1));
+            p->size1 = own->size1;
+            p->chash = own->chash;
+        } else {
+            p->times1[0].tv_sec = -2L;
+            p->times1[0].tv_nsec = 0L;
+            p->times1[1].tv_sec = -1L;
+            p->times1[1].tv_nsec = 0L;
+            p->size1 = -1;
+            p->chash = 0;
+        }
+        tab_insert(&newtab, p);
+    }
+    p->times2[0].tv_sec = sb->st_atime;
+    p->times2[0].tv_nsec = sb->st_atim.tv_nsec;
+    p->times2[1].tv_sec = sb->st_mtime;
+    p->times2[1].tv_nsec = sb->st_mtim.tv_nsec;
+    p->size2 = sb->st_size;
+    p->dev = sb->st_dev;
+    p->ino = sb->st_ino;
+    p->gen = scan_gen;
+}
+
+/*
+ * Parallel directory walker. The traversal and the per-file stat are
+ * almost entirely syscall-latency-bound (especially on NFS) so a pool
+ * of threads divides pending directories among themselves and collects
+ * (path, stat) results into per-thread lists. The per-file callback is
+ * then run serially over the merged lists since tsearch et al have no
+ * concurrent story. Thread count defaults to the online CPU count and
+ * can be overridden with $PMASH_THREADS; 1 gives the old serial walk.
+ */
+
+typedef void (*entry_f)(const char *fpath, const struct stat *sb);
+
+// Directory stat records, kept when a snapshot may be saved: any file
+// created or removed bumps its parent directory's mtime, so directory
+// times are a cheap validity check for a persisted baseline.
+typedef struct {
+    const char *path;
+    uint64_t hash;
+    unsigned gen;   /* post-scan generation which last descended here */
+    struct timespec dtimes[2];      /* atime, mtime */
+} direntry_s;
+
+static pathtab_s dirtab;
+static int record_dirs;
+
+/*
+ * Directory-mtime pruning (-P). Creating, deleting or renaming a file
+ * bumps its parent directory's mtime, and once directory atimes are
+ * primed behind their mtimes a readdir bumps the atime, so a directory
+ * whose stat times exactly match the baseline saw neither of those.
+ * The post-scan can then skip descending into such subtrees, making a
+ * recipe that touches a handful of directories nearly O(changed)
+ * instead of O(tree). The catch is that opening a file by direct path
+ * updates neither of its parent's times, so a prereq read inside an
+ * otherwise untouched directory is invisible at the directory level -
+ * which is why this is opt-in, for recipe styles (and filesystems with
+ * fine-grained timestamps) where that trade-off is known to be safe.
+ */
+static int prune_dirs;      /* -P given */
+static int dir_priming;     /* current walk primes directory atimes */
+static int pruning_active;  /* current walk may skip unchanged dirs */
+
+// Callers must serialize; walker threads hold the queue mutex here.
+static void
+dir_entry(const char *dpath, const struct stat *sb)
+{
+    direntry_s *d;
+    uint64_t hash;
+
+    if (!record_dirs) {
+        return;
+    }
+    if (dpath[0] == '.' && dpath[1] == '/') {
+        dpath += 2;
+    }
+    hash = pathhash(dpath);
+    if (!(d = tab_find(&dirtab, dpath, hash))) {
+        d = arena_alloc(&perm_arena, sizeof(direntry_s));
+        d->path = arena_strdup(&perm_arena, dpath);
+        d->hash = hash;
+        tab_insert(&dirtab, d);
+    }
+    d->gen = scan_gen;
+    d->dtimes[0].tv_sec = sb->st_atime;
+    d->dtimes[0].tv_nsec = sb->st_atim.tv_nsec;
+    d->dtimes[1].tv_sec = sb->st_mtime;
+    d->dtimes[1].tv_nsec = sb->st_mtim.tv_nsec;
+}
+
+// Prime a directory's atime behind its mtime (just like a file) and
+// record the primed times as its baseline. Serial callers only.
+static void
+dir_prime(const char *dpath)
+{
+    struct stat dst;
+    struct timespec dt[2];
+
+    if (lstat(dpath, &dst) == -1) {
+        return;
+    }
+    if (tscmp(&dst.st_atim, &dst.st_mtim) < 0) {
+        // Already behind mtime (noatime mount, or never read since
+        // the last priming): no metadata write needed.
+        dir_entry(dpath, &dst);
+        return;
+    }
+    dt[0].tv_sec = dst.st_mtime - 1;
+    dt[0].tv_nsec = 0L;
+    dt[1].tv_sec = dst.st_mtime;
+    dt[1].tv_nsec = dst.st_mtim.tv_nsec;
+    if (utimensat(AT_FDCWD, dpath, dt, 0) == -1) {
+        return;
+    }
+    dst.st_atim = dt[0];
+    dir_entry(dpath, &dst);
+}
+
+// Holds only if the directory is in the baseline with both stat times
+// exactly as recorded there.
+static int
+dir_unchanged(const char *dpath, const struct stat *sb)
+{
+    direntry_s *d;
+
+    if (dpath[0] == '.' && dpath[1] == '/') {
+        dpath += 2;
+    }
+    if (!(d = tab_find(&dirtab, dpath, pathhash(dpath)))) {
+        return 0;
+    }
+    return d->dtimes[0].tv_sec == sb->st_atime &&
+        d->dtimes[0].tv_nsec == sb->st_atim.tv_nsec &&
+        d->dtimes[1].tv_sec == sb->st_mtime &&
+        d->dtimes[1].tv_nsec == sb->st_mtim.tv_nsec;
+}
+
+// Re-stat one directory record after our own output churn: renaming
+// the staged depsfile into place (and unlinking its temp) bumps the
+// parent directory's mtime after the post-scan recorded it, which
+// would invalidate every snapshot whose depsfile lives in the watch
+// tree - the normal "-d $@.d" layout.
+static void
+dir_refresh(const char *fpath)
+{
+    char *dir, *slash;
+    struct stat dst;
+
+    if (!record_dirs) {
+        return;
+    }
+    insist((dir = strdup(fpath)) != NULL, "strdup()");
+    if ((slash = strrchr(dir, '/'))) {
+        *slash = '\0';
+    } else {
+        dir[0] = '.';
+        dir[1] = '\0';
+    }
+    if (lstat(dir, &dst) == 0) {
+        dir_entry(dir, &dst);
+    }
+    free(dir);
+}
+
+typedef struct fent {
+    struct fent *next;
+    struct stat st;
+    char path[];
+} fent_s;
+
+/*
+ * Bounded stat-result queue between the walker threads and the main
+ * thread. The walkers used to accumulate private fent_s lists which
+ * the main thread merged only after joining them all, so scan latency
+ * was walk time plus merge time and peak memory held every stat result
+ * at once. Instead the walkers now feed this queue and the main thread
+ * drains it concurrently, running the pre/post classification against
+ * the baseline while directory reads are still in flight - NFS wait
+ * overlapped with hash-table CPU work - and retiring each entry
+ * immediately, so no more than FENTQ_MAX results ever exist at once.
+ * The main thread stays the sole consumer, which is what lets the
+ * baseline tables keep running without locks.
+ */
+
+#define FENTQ_MAX 4096
+
+typedef struct {
+    fent_s *head, *tail;
+    size_t n;
+    unsigned finished;          /* walker threads that have exited */
+    pthread_mutex_t mtx;
+    pthread_cond_t notempty, notfull;
+} fentq_s;
+
+static fentq_s fq;
+
+static void
+fentq_push(fent_s *fe)
+{
+    pthread_mutex_lock(&fq.mtx);
+    while (fq.n == FENTQ_MAX) {
+        pthread_cond_wait(&fq.notfull, &fq.mtx);
+    }
+    fe->next = NULL;
+    if (fq.tail) {
+        fq.tail->next = fe;
+    } else {
+        fq.head = fe;
+    }
+    fq.tail = fe;
+    fq.n++;
+    pthread_cond_signal(&fq.notempty);
+    pthread_mutex_unlock(&fq.mtx);
+}
+
+typedef struct {
+    char **dirs;                /* growable queue of pending directories */
+    size_t len, cap, next;
+    unsigned active;            /* threads currently reading a directory */
+    dev_t rootdev;              /* don't cross mount points (a la FTW_MOUNT) */
+    pthread_mutex_t mtx;
+    pthread_cond_t cnd;
+} walkq_s;
+
+static walkq_s wq;
+
+static void
+walkq_push(char *dir)
+{
+    if (wq.len == wq.cap) {
+        wq.cap = wq.cap ? wq.cap * 2 : 64;
+        insist((wq.dirs = realloc(wq.dirs, wq.cap * sizeof(char *))) != NULL,
+                "realloc(walkq)");
+    }
+    wq.dirs[wq.len++] = dir;
+}
+
+/*
+ * Stat layer for the walkers. On Linux every stat goes through statx()
+ * requesting only the fields pmash actually reads rather than the full
+ * basic set, which spares an NFS server part of the GETATTR work per
+ * file. With --dont-sync the pre-scan additionally passes
+ * AT_STATX_DONT_SYNC so cached attributes satisfy the request with no
+ * round trip at all; that is safe for the baseline because any file
+ * the recipe then touches gets a fresh, synchronized stat from the
+ * post-scan, so staleness can only make an untouched file look
+ * untouched. Kernels without statx fall back to fstatat() after the
+ * first ENOSYS.
+ */
+
+static int dont_sync;       /* --dont-sync given */
+static int statx_nosync;    /* current walk may use cached attributes */
+
+#ifdef STATX_TYPE
+
+#define PMASH_STATX_MASK (STATX_TYPE|STATX_ATIME|STATX_MTIME|STATX_SIZE| \
+                          STATX_INO)
+
+static int statx_broken;    /* runtime ENOSYS latch, set at most once */
+
+static unsigned
+statx_flags(void)
+{
+    return AT_SYMLINK_NOFOLLOW | (statx_nosync ? AT_STATX_DONT_SYNC : 0);
+}
+
+static void
+stx_to_stat(const struct statx *stx, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode = stx->stx_mode;
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_size = stx->stx_size;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+#endif /* STATX_TYPE */
+
+static int
+walker_stat(int dfd, const char *name, struct stat *st)
+{
+#ifdef STATX_TYPE
+    if (!statx_broken) {
+        struct statx stx;
+
+        if (statx(dfd, name, statx_flags(), PMASH_STATX_MASK, &stx) == 0) {
+            stx_to_stat(&stx, st);
+            return 0;
+        }
+        if (errno != ENOSYS && errno != EINVAL) {
+            return -1;
+        }
+        statx_broken = 1;
+    }
+#endif
+    return fstatat(dfd, name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+/*
+ * io_uring batched stat. A directory full of files used to cost one
+ * synchronous fstatat round trip each; with a small raw ring (no
+ * liburing dependency) the walker submits them as batches of STATX
+ * ops, so hundreds of NFS GETATTRs overlap per io_uring_enter call.
+ * Each walker thread owns a ring; if setup fails (old kernel, seccomp)
+ * or $PMASH_NO_URING is set, the serial walker_stat path is used
+ * instead. There is no utimensat opcode in io_uring so the priming
+ * writes cannot batch the same way.
+ */
+
+#define URING_QD 64
+
+typedef struct {
+    char *path;
+    const char *name;   /* basename, for dirfd-relative stat */
+    struct stat st;
+    int res;
+} stbatch_s;
+
+#ifdef HAVE_URING
+
+typedef struct {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} uring_s;
+
+static int
+uring_init(uring_s *u)
+{
+    struct io_uring_params pr;
+    void *sq_ring, *cq_ring;
+    size_t sq_sz, cq_sz;
+
+    u->fd = -1;
+    if (getenv("PMASH_NO_URING")) {
+        return -1;
+    }
+    memset(&pr, 0, sizeof(pr));
+    if ((u->fd = (int)syscall(__NR_io_uring_setup, URING_QD, &pr)) == -1) {
+        return -1;
+    }
+    sq_sz = pr.sq_off.array + pr.sq_entries * sizeof(unsigned);
+    cq_sz = pr.cq_off.cqes + pr.cq_entries * sizeof(struct io_uring_cqe);
+    if (pr.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_sz > sq_sz) {
+            sq_sz = cq_sz;
+        }
+        cq_sz = sq_sz;
+    }
+    sq_ring = mmap(NULL, sq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+            u->fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        (void)close(u->fd);
+        u->fd = -1;
+        return -1;
+    }
+    if (pr.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(NULL, cq_sz, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            (void)close(u->fd);
+            return -1;
+        }
+    }
+    u->sqes = mmap(NULL, pr.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+            u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        (void)close(u->fd);
+        u->fd = -1;
+        return -1;
+    }
+    u->sq_entries = pr.sq_entries;
+    u->sq_head = (unsigned *)((char *)sq_ring + pr.sq_off.head);
+    u->sq_tail = (unsigned *)((char *)sq_ring + pr.sq_off.tail);
+    u->sq_mask = (unsigned *)((char *)sq_ring + pr.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)sq_ring + pr.sq_off.array);
+    u->cq_head = (unsigned *)((char *)cq_ring + pr.cq_off.head);
+    u->cq_tail = (unsigned *)((char *)cq_ring + pr.cq_off.tail);
+    u->cq_mask = (unsigned *)((char *)cq_ring + pr.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)cq_ring + pr.cq_off.cqes);
+    return 0;
+}
+
+// Stat a directory's worth of names in URING_QD-sized batches.
+static void
+uring_statx(uring_s *u, int dfd, stbatch_s *batch, unsigned n,
+        struct statx *stxs)
+{
+    unsigned next = 0, done = 0;
+
+    while (done < n) {
+        unsigned i, k = n - next;
+        unsigned tail = *u->sq_tail, head;
+
+        if (k > u->sq_entries) {
+            k = u->sq_entries;
+        }
+        for (i = 0; i < k; i++, next++) {
+            struct io_uring_sqe *sqe = &u->sqes[tail & *u->sq_mask];
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dfd;
+            sqe->addr = (uint64_t)(uintptr_t)batch[next].name;
+            sqe->len = PMASH_STATX_MASK;
+            sqe->off = (uint64_t)(uintptr_t)&stxs[next];
+            sqe->statx_flags = statx_flags();
+            sqe->user_data = next;
+            u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+            tail++;
+        }
+        __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+        insist(syscall(__NR_io_uring_enter, u->fd, k, k,
+                    IORING_ENTER_GETEVENTS, NULL, 0) >= 0,
+                "io_uring_enter()");
+        head = *u->cq_head;
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            struct statx *stx = &stxs[cqe->user_data];
+            stbatch_s *b = &batch[cqe->user_data];
+
+            b->res = cqe->res;
+            if (cqe->res == 0) {
+                stx_to_stat(stx, &b->st);
+            }
+            head++;
+            done++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+#else /* !HAVE_URING */
+
+typedef struct {
+    int fd;
+} uring_s;
+
+static int
+uring_init(uring_s *u)
+{
+    u->fd = -1;
+    return -1;
+}
+
+#endif /* HAVE_URING */
+
+static void
+walk_dir(const char *dir, uring_s *ur)
+{
+    DIR *d;
+    struct dirent *de;
+    stbatch_s *batch = NULL;
+    size_t nb = 0, cap = 0, i;
+
+    if ((d = opendir(dir)) == NULL) {
+        fprintf(stderr, "%s: Warning: skipping %s: %s\n",
+                prog, dir, strerror(errno));
+        return;
+    }
+
+    // First collect the names, then stat them - as one io_uring batch
+    // per chunk when a ring is available, serially otherwise.
+    while ((de = readdir(d))) {
+        char *path;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        if (!strcmp(dir, ".")) {
+            insist(asprintf(&path, "%s", de->d_name) != -1, "asprintf()");
+        } else {
+            insist(asprintf(&path, "%s/%s", dir, de->d_name) != -1, "asprintf()");
+        }
+        if (excluded(path)) {
+            free(path);
+            continue;
+        }
+        if (nb == cap) {
+            cap = cap ? cap * 2 : 64;
+            insist((batch = realloc(batch, cap * sizeof(stbatch_s))) != NULL,
+                    "realloc(stbatch)");
+        }
+        batch[nb].path = path;
+        batch[nb].name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+        batch[nb].res = -1;
+        nb++;
+    }
+
+#ifdef HAVE_URING
+    if (ur->fd != -1 && nb > 1) {
+        struct statx *stxs;
+
+        insist((stxs = malloc(nb * sizeof(struct statx))) != NULL,
+                "malloc(statx)");
+        uring_statx(ur, dirfd(d), batch, nb, stxs);
+        free(stxs);
+    } else
+#endif
+    {
+        (void)ur;
+        for (i = 0; i < nb; i++) {
+            batch[i].res = walker_stat(dirfd(d), batch[i].name, &batch[i].st);
+            if (batch[i].res == -1) {
+                batch[i].res = -errno;
+            }
+        }
+    }
+
+    for (i = 0; i < nb; i++) {
+        char *path = batch[i].path;
+        struct stat st = batch[i].st;
+        fent_s *fe;
+
+        if (batch[i].res != 0) {
+            free(path);
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (st.st_dev == wq.rootdev) {
+                pthread_mutex_lock(&wq.mtx);
+                if (pruning_active && dir_unchanged(path, &st)) {
+                    stats.pruned++;
+                    pthread_mutex_unlock(&wq.mtx);
+                    free(path);
+                } else {
+                    dir_entry(path, &st);
+                    walkq_push(path);
+                    pthread_cond_broadcast(&wq.cnd);
+                    pthread_mutex_unlock(&wq.mtx);
+                }
+            } else {
+                free(path);
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            insist((fe = malloc(sizeof(fent_s) + strlen(path) + 1)) != NULL,
+                    "malloc(fent_s)");
+            fe->st = st;
+            strcpy(fe->path, path);
+            fentq_push(fe);
+            free(path);
+        } else {
+            free(path);
+        }
+    }
+    free(batch);
+    (void)closedir(d);
+
+    // Our own readdir above just bumped this directory's atime; prime
+    // it back behind the mtime so a recipe readdir is detectable.
+    if (dir_priming) {
+        pthread_mutex_lock(&wq.mtx);
+        dir_prime(dir);
+        pthread_mutex_unlock(&wq.mtx);
+    }
+}
+
+static void *
+walk_thread(void *arg)
+{
+    uring_s ur;
+
+    (void)arg;
+    (void)uring_init(&ur);
+    pthread_mutex_lock(&wq.mtx);
+    while (1) {
+        char *dir;
+
+        if (wq.next == wq.len) {
+            if (wq.active == 0) {
+                pthread_cond_broadcast(&wq.cnd);
+                break;
+            }
+            pthread_cond_wait(&wq.cnd, &wq.mtx);
+            continue;
+        }
+        dir = wq.dirs[wq.next++];
+        wq.active++;
+        stats.dirs++;
+        pthread_mutex_unlock(&wq.mtx);
+        walk_dir(dir, &ur);
+        free(dir);
+        pthread_mutex_lock(&wq.mtx);
+        wq.active--;
+        if (wq.next == wq.len && wq.active == 0) {
+            pthread_cond_broadcast(&wq.cnd);
+        }
+    }
+    pthread_mutex_unlock(&wq.mtx);
+    if (ur.fd != -1) {
+        (void)close(ur.fd);
+    }
+    pthread_mutex_lock(&fq.mtx);
+    stats_fold();
+    fq.finished++;
+    pthread_cond_signal(&fq.notempty);
+    pthread_mutex_unlock(&fq.mtx);
+    return NULL;
+}
+
+static unsigned
+walk_nthreads(void)
+{
+    long n;
+    char *ev;
+
+    if ((ev = getenv("PMASH_THREADS"))) {
+        n = atol(ev);
+    } else {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (n < 1) {
+        n = 1;
+    } else if (n > MAXWALKERS) {
+        n = MAXWALKERS;
+    }
+    return (unsigned)n;
+}
+
+static void
+walk(const char *path, entry_f fn)
+{
+    struct stat st;
+    unsigned i, nthreads = walk_nthreads();
+    pthread_t thr[MAXWALKERS];
+
+    insist(stat(path, &st) != -1, path);
+    if (!S_ISDIR(st.st_mode)) {
+        if (!excluded(path)) {
+            fn(path, &st);
+        }
+        return;
+    }
+    dir_entry(path, &st);
+
+    wq.len = wq.next = 0;
+    wq.active = 0;
+    wq.rootdev = st.st_dev;
+    pthread_mutex_init(&wq.mtx, NULL);
+    pthread_cond_init(&wq.cnd, NULL);
+    walkq_push(strdup(path));
+
+    fq.head = fq.tail = NULL;
+    fq.n = 0;
+    fq.finished = 0;
+    pthread_mutex_init(&fq.mtx, NULL);
+    pthread_cond_init(&fq.notempty, NULL);
+    pthread_cond_init(&fq.notfull, NULL);
+
+    for (i = 0; i < nthreads; i++) {
+        insist(pthread_create(&thr[i], NULL, walk_thread, NULL) == 0,
+                "pthread_create()");
+    }
+
+    // Drain the queue while the walkers are still filling it, running
+    // the callback on each result as it arrives. Batches are detached
+    // whole so the lock is taken once per burst, not once per file.
+    pthread_mutex_lock(&fq.mtx);
+    while (1) {
+        fent_s *fe, *next;
+
+        while (fq.head == NULL && fq.finished < nthreads) {
+            pthread_cond_wait(&fq.notempty, &fq.mtx);
+        }
+        fe = fq.head;
+        fq.head = fq.tail = NULL;
+        fq.n = 0;
+        pthread_cond_broadcast(&fq.notfull);
+        if (!fe) {
+            break;
+        }
+        pthread_mutex_unlock(&fq.mtx);
+        for (; fe; fe = next) {
+            const char *fpath = fe->path;
+
+            if (fpath[0] == '.' && fpath[1] == '/') {
+                fpath += 2;
+            }
+            stats.files++;
+            fn(fpath, &fe->st);
+            next = fe->next;
+            free(fe);
+        }
+        pthread_mutex_lock(&fq.mtx);
+    }
+    pthread_mutex_unlock(&fq.mtx);
+
+    for (i = 0; i < nthreads; i++) {
+        (void)pthread_join(thr[i], NULL);
+    }
+}
+
+/*
+ * Command execution. system() forks the entire pmash image -- painful
+ * once the baseline index holds a big tree -- and interposes /bin/sh
+ * even when the recipe is one straightforward exec. Recipes containing
+ * no shell metacharacters are split on whitespace and spawned directly;
+ * everything else still gets sh -c, but via posix_spawn with vfork
+ * semantics so the parent's address space is never duplicated. The
+ * return convention matches system(): the raw wait status, or -1.
+ */
+
+static int
+needs_shell(const char *cmd)
+{
+    // An environment-assignment prefix (FOO=bar cmd) is shell syntax
+    // too: an '=' in the first word can't be exec'd directly.
+    if (memchr(cmd, '=', strcspn(cmd, " \t"))) {
+        return 1;
+    }
+    return cmd[strcspn(cmd, "|&;<>()$`\\\"'*?[]{}#~\n")] != '\0';
+}
+
+static int
+run_cmd(const char *cmdstr)
+{
+    posix_spawnattr_t attr;
+    char *words = NULL, *word, *saved;
+    char *argv[64];
+    pid_t pid;
+    int rc, status, argc = 0;
+
+    posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_USEVFORK
+    (void)posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK);
+#endif
+
+    if (!needs_shell(cmdstr)) {
+        words = strdup(cmdstr);
+        insist(words != NULL, "strdup(cmdstr)");
+        for (word = strtok_r(words, " \t", &saved); word;
+                word = strtok_r(NULL, " \t", &saved)) {
+            if (argc == (int)(sizeof(argv)/sizeof(argv[0])) - 1) {
+                // Too many words to spawn directly; never run a
+                // truncated command - let the shell have the whole line.
+                argc = 0;
+                break;
+            }
+            argv[argc++] = word;
+        }
+        argv[argc] = NULL;
+    }
+
+    if (argc) {
+        rc = posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ);
+    } else {
+        // Empty or shell-dependent command: hand it to sh -c as before.
+        argv[0] = "sh";
+        argv[1] = "-c";
+        argv[2] = (char *)cmdstr;
+        argv[3] = NULL;
+        rc = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, environ);
+    }
+    posix_spawnattr_destroy(&attr);
+    if (rc) {
+        // The shell would have complained for us; spawn failures won't.
+        fprintf(stderr, "%s: Error: %s: %s\n", prog,
+                argc ? argv[0] : "/bin/sh", strerror(rc));
+        free(words);
+        errno = rc;
+        return -1;
+    }
+    free(words);
+    if (waitpid(pid, &status, 0) == -1) {
+        return -1;
+    }
+    return status;
+}
+
+static int
+is_prereq(pathentry_s *p)
+{
+    // A changed fingerprint means a rewrite the clock couldn't see.
+    if (verify_modified(p)) {
+        return 0;
+    }
+    // If mtime has moved it's a target
+    // and if atime hasn't moved it's unused. Full-timespec compares:
+    // a lazily-primed baseline records the file's real sub-second
+    // atime, so a read can move it within the same whole second.
+    if (tscmp(&p->times2[1], &p->times1[1]) > 0) {
+        return 0;
+    }
+    return tscmp(&p->times2[0], &p->times1[0]) > 0;
+}
+
+/*
+ * Probe-verdict cache. Whether a filesystem updates atimes never
+ * changes mid-build, yet the temp-file probe costs eight syscalls per
+ * watch dir per invocation - real minutes across tens of thousands of
+ * recipes on NFS. Verdicts are therefore cached by st_dev, both in the
+ * environment ($PMASH_ATIME_OK, a comma-separated dev list inherited
+ * by child invocations) and in a small state file shared by sibling
+ * invocations; --no-probe skips probing outright for orchestrated runs
+ * that have already verified their mounts.
+ *
+ * The kernel assigns dev numbers dynamically and reuses them across
+ * remounts and reboots, so a verdict in the state file is only trusted
+ * within the boot that wrote it: the file's first line names the boot,
+ * and a mismatch invalidates the whole file. The environment list needs
+ * no such check - it can't outlive the build that set it.
+ */
+
+static int no_probe;
+
+static const char *
+boot_id(void)
+{
+    static char id[64];
+    static int primed;
+    FILE *f;
+
+    if (!primed) {
+        primed = 1;
+        if ((f = fopen("/proc/sys/kernel/random/boot_id", "r"))) {
+            if (fgets(id, sizeof(id), f)) {
+                id[strcspn(id, "\n")] = '\0';
+            }
+            fclose(f);
+        }
+    }
+    return id;
+}
+
+static int
+probe_file_current(FILE *cf)
+{
+    char line[64];
+
+    if (!*boot_id() || !fgets(line, sizeof(line), cf) || line[0] != '#') {
+        return 0;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    return strcmp(line + 2, boot_id()) == 0;
+}
+
+static const char *
+probe_cachefile(void)
+{
+    static char *cachefile;
+
+    if (!cachefile && !(cachefile = getenv("PMASH_PROBE_CACHE"))) {
+        insist(asprintf(&cachefile, "%s/.pmash.probe.%ld",
+                    getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp",
+                    (long)getuid()) != -1, "asprintf()");
+    }
+    return cachefile;
+}
+
+static int
+probe_cached(dev_t dev)
+{
+    const char *env;
+    char line[64];
+    FILE *cf;
+    int hit = 0;
+
+    if ((env = getenv("PMASH_ATIME_OK"))) {
+        char *tok, *save, *dup = strdup(env);
+
+        for (tok = strtok_r(dup, ",", &save); tok;
+                tok = strtok_r(NULL, ",", &save)) {
+            if (strtoul(tok, NULL, 10) == (unsigned long)dev) {
+                hit = 1;
+                break;
+            }
+        }
+        free(dup);
+        if (hit) {
+            return 1;
+        }
+    }
+    if ((cf = fopen(probe_cachefile(), "r"))) {
+        if (probe_file_current(cf)) {
+            while (!hit && fgets(line, sizeof(line), cf)) {
+                hit = strtoul(line, NULL, 10) == (unsigned long)dev;
+            }
+        }
+        fclose(cf);
+    }
+    return hit;
+}
+
+static void
+probe_remember(dev_t dev)
+{
+    const char *env;
+    char *val;
+    FILE *cf;
+    int fd, fresh = 1;
+
+    if ((cf = fopen(probe_cachefile(), "r"))) {
+        fresh = !probe_file_current(cf);
+        fclose(cf);
+    }
+    // Appends are small enough to be atomic so no locking is needed; a
+    // file from an earlier boot is replaced whole, header plus verdict
+    // in one write, so where it exists it's never headerless. Without a
+    // boot id to stamp it with, skip the file and rely on $PMASH_ATIME_OK.
+    if (fresh && *boot_id()) {
+        if ((fd = open(probe_cachefile(), O_WRONLY|O_CREAT|O_TRUNC, 0644))
+                != -1) {
+            char line[128];
+            int len;
+
+            len = snprintf(line, sizeof(line), "# %s\n%lu\n",
+                    boot_id(), (unsigned long)dev);
+            (void)!write(fd, line, len);
+            (void)close(fd);
+        }
+    } else if (!fresh && (fd = open(probe_cachefile(),
+                    O_WRONLY|O_CREAT|O_APPEND, 0644)) != -1) {
+        char line[32];
+        int len;
+
+        len = snprintf(line, sizeof(line), "%lu\n", (unsigned long)dev);
+        (void)!write(fd, line, len);
+        (void)close(fd);
+    }
+    env = getenv("PMASH_ATIME_OK");
+    insist(asprintf(&val, "%s%s%lu", env ? env : "", env ? "," : "",
+                (unsigned long)dev) != -1, "asprintf()");
+    insist(setenv("PMASH_ATIME_OK", val, 1) == 0, "setenv()");
+    free(val);
+}
+
+/*
+ * Create, read, and remove a temp file to check that
+ * atimes are being updated.
+ */
+static void
+atime_probe(const char *path)
+{
+    char *tmpf;
+    char buf[] = {"data\n"};
+    struct stat ostats, nstats;
+    struct timespec otimes[2] = {{-1, 0L}, {0, UTIME_OMIT}};
+    int fd;
+
+    insist((asprintf(&tmpf, "%s/audit.%ld.tmp", path,
+                    (long)getpid())) != -1, "asprintf()");
+    insist((fd = open(tmpf, O_CREAT|O_WRONLY|O_EXCL, 0644)) != -1, tmpf);
+    insist(write(fd, buf, strlen(buf)) != -1, tmpf);
+    insist(fstat(fd, &ostats) != -1, tmpf);
+    otimes[0].tv_sec = ostats.st_mtime - 1;
+    insist(futimens(fd, otimes) != -1, tmpf);
+    insist(close(fd) != -1, tmpf);
+    insist((fd = open(tmpf, O_RDONLY)) != -1, tmpf);
+    insist(read(fd, buf, sizeof(buf)) != -1, tmpf);
+    insist(close(fd) != -1, tmpf);
+    insist(stat(tmpf, &nstats) != -1, tmpf);
+    insist(unlink(tmpf) != -1, tmpf);
+    (void)free(tmpf);
+    if (nstats.st_atime < nstats.st_mtime ||
+            (nstats.st_atime == nstats.st_mtime &&
+             nstats.st_atim.tv_nsec < nstats.st_mtim.tv_nsec)) {
+        die("atimes not updated here");
+    }
+}
+
+static void
+pre_scan(const char *watchdirs)
+{
+    char *path;
+
+    dir_priming = prune_dirs;
+    statx_nosync = dont_sync;
+    for (path = strtok(strdup(watchdirs), ","); path; path = strtok(NULL, ",")) {
+        struct stat st;
+
+        if (!no_probe &&
+                !(stat(path, &st) == 0 && probe_cached(st.st_dev))) {
+            atime_probe(path);
+            if (stat(path, &st) == 0) {
+                probe_remember(st.st_dev);
+            }
+        }
+        walk(path, pre_entry);
+    }
+    dir_priming = 0;
+    statx_nosync = 0;
+}
+
+/*
+ * --restore-times: put back the pre-audit atimes of files the command
+ * never touched, so a scheduled audit leaves a developer's incremental
+ * tree (and the NFS attribute caches over it) as it found it. Only
+ * unused files need repair - their atime was moved by our own priming,
+ * not by the build - and mtime is left alone via UTIME_OMIT. Files the
+ * command really read keep their honest new atimes, and files whose
+ * priming was skipped lazily were never disturbed in the first place.
+ */
+static int restore_times;
+
+static void
+restore_atimes(void)
+{
+    size_t i;
+    unsigned long n = 0;
+
+    for (i = 0; i < tab1.cap; i++) {
+        pathentry_s *p = tab1.slots[i];
+        struct timespec times[2];
+
+        if (!p || p->gen != scan_gen) {
+            continue;
+        }
+        if (tscmp(&p->times2[0], &p->times1[0]) ||
+                tscmp(&p->times2[1], &p->times1[1])) {
+            continue;   /* touched by the command: leave it honest */
+        }
+        if (!p->atime0.tv_sec || !tscmp(&p->atime0, &p->times1[0])) {
+            continue;   /* never primed, or priming was a no-op */
+        }
+        times[0] = p->atime0;
+        times[1].tv_sec = 0;
+        times[1].tv_nsec = UTIME_OMIT;
+        if (utimensat(AT_FDCWD, p->path, times, 0) == 0) {
+            n++;
+        }
+    }
+    if (verbosity) {
+        fprintf(stderr, "%s: restored %lu atimes\n", prog, n);
+    }
+}
+
+static void
+post_scan(const char *watchdirs)
+{
+    char *path;
+
+    // Bump the generation so stale times2 values left in baseline
+    // entries by earlier recipes can never leak into this audit.
+    scan_gen++;
+    pruning_active = prune_dirs;
+    for (path = strtok(strdup(watchdirs), ","); path; path = strtok(NULL, ",")) {
+        walk(path, post_entry);
+    }
+    pruning_active = 0;
+}
+
+// The audited set is the union of baseline entries seen by this
+// post-scan and the new-file side table, sorted for determinism.
+static void **
+audit_sorted(size_t *np)
+{
+    void **sorted;
+    size_t i, n = 0;
+
+    insist((sorted = malloc((tab1.cnt + newtab.cnt + 1) * sizeof(void *)))
+            != NULL, "malloc(audit_sorted)");
+    for (i = 0; i < tab1.cap; i++) {
+        pathentry_s *p = tab1.slots[i];
+
+        if (p && p->gen == scan_gen) {
+            sorted[n++] = p;
+        }
+    }
+    for (i = 0; i < newtab.cap; i++) {
+        if (newtab.slots[i]) {
+            sorted[n++] = newtab.slots[i];
+        }
+    }
+    qsort(sorted, n, sizeof(void *), pathcmp);
+    *np = n;
+    return sorted;
+}
+
+/*
+ * Deps output buffer. The whole deps file is rendered into one
+ * contiguous growable buffer and handed to stdio as a single write
+ * rather than a fputs/fputc per token, and real deps files are staged
+ * through a temp file renamed into place so concurrent readers (make
+ * re-including .d files mid-build) never see torn output.
+ */
+
+typedef struct {
+    char *mem;
+    size_t len, cap;
+} obuf_s;
+
+static void
+obuf_add(obuf_s *ob, const char *s, size_t len)
+{
+    if (ob->len + len > ob->cap) {
+        ob->cap = ob->cap ? ob->cap * 2 : 4096;
+        if (ob->len + len > ob->cap) {
+            ob->cap = ob->len + len;
+        }
+        insist((ob->mem = realloc(ob->mem, ob->cap)) != NULL, "realloc(obuf)");
+    }
+    memcpy(ob->mem + ob->len, s, len);
+    ob->len += len;
+}
+
+static void
+obuf_str(obuf_s *ob, const char *s)
+{
+    obuf_add(ob, s, strlen(s));
+}
+
+/*
+ * Shared dependency database (-D). Instead of leaving one tiny .d file
+ * per recipe for make to re-open by the tens of thousands on every
+ * incremental build, each audit can append its record to a single
+ * flock-serialized log; the pmadep companion tool turns the whole log
+ * into one make-format stream (latest record per target wins). A
+ * record is the target name followed by its prereqs, one per line,
+ * terminated by a blank line, written with a single write under
+ * LOCK_EX so parallel scoped jobs can share the file safely.
+ */
+
+static void
+depsdb_append(const obuf_s *rec)
+{
+    int fd;
+
+    insist((fd = open(depsdb, O_WRONLY|O_CREAT|O_APPEND, 0644)) != -1,
+            depsdb);
+    insist(flock(fd, LOCK_EX) != -1, depsdb);
+    insist(write(fd, rec->mem, rec->len) == (ssize_t)rec->len, depsdb);
+    insist(close(fd) != -1, depsdb);
+}
+
+// A rewrite that doesn't change the content would still bump the .d
+// file's mtime, invalidating make's include cache and dirtying NFS
+// client caches for nothing - on a warm incremental build that's most
+// of the depsfiles. Compare the rendered buffer against what's on disk
+// (size first, then content) so an identical result can keep the old
+// file untouched.
+static int deps_same;
+
+static int
+deps_unchanged(const obuf_s *ob)
+{
+    char buf[65536];
+    struct stat st;
+    size_t off = 0;
+    FILE *old;
+    int same = 1;
+
+    if (stat(depsfile, &st) == -1 || (size_t)st.st_size != ob->len) {
+        return 0;
+    }
+    if ((old = fopen(depsfile, "r")) == NULL) {
+        return 0;
+    }
+    while (same && off < ob->len) {
+        size_t got = fread(buf, 1, sizeof(buf), old);
+
+        if (got == 0 || memcmp(ob->mem + off, buf, got)) {
+            same = 0;
+        }
+        off += got;
+    }
+    (void)fclose(old);
+    return same && off == ob->len;
+}
+
+// The target name is the depsfile minus its extension ("x.o.d" names
+// target "x.o"); a depsfile with no dot names the target as-is.
+static size_t
+deps_stem(void)
+{
+    const char *e = strrchr(depsfile, '.');
+
+    return e ? (size_t)(e - depsfile) : strlen(depsfile);
+}
+
+static void
+emit_deps(void)
+{
+    obuf_s ob = {NULL, 0, 0};
+    obuf_s dbrec = {NULL, 0, 0};
+    void **sorted;
+    size_t i, n;
+
+    if (depsdb && depsfile) {
+        obuf_str(&dbrec, "T ");
+        obuf_add(&dbrec, depsfile, deps_stem());
+        obuf_add(&dbrec, "\n", 1);
+    }
+    sorted = audit_sorted(&n);
+    for (i = 0; i < n; i++) {
+        pathentry_s *p = sorted[i];
+
+        if (!is_prereq(p)) {
+            continue;
+        }
+        if (depsdb && depsfile) {
+            obuf_str(&dbrec, "P ");
+            obuf_str(&dbrec, p->path);
+            obuf_add(&dbrec, "\n", 1);
+        }
+        if (depsfile) {
+            if (prq_count++) {
+                obuf_str(&ob, " \\\n  ");
+            } else {
+                obuf_add(&ob, depsfile, deps_stem());
+                obuf_str(&ob, ": \\\n  ");
+            }
+            obuf_str(&ob, p->path);
+        } else {
+            obuf_str(&ob, p->path);
+            obuf_add(&ob, "\n", 1);
+        }
+    }
+    obuf_add(&ob, "\n", 1);
+    if (depsfile) {
+        for (i = 0; i < n; i++) {
+            pathentry_s *p = sorted[i];
+
+            if (is_prereq(p)) {
+                obuf_add(&ob, "\n", 1);
+                obuf_str(&ob, p->path);
+                obuf_str(&ob, ":\n");
+            }
+        }
+    }
+    if (depsfile && deps_unchanged(&ob)) {
+        deps_same = 1;
+        if (verbosity) {
+            fprintf(stderr, "%s: deps unchanged: %s\n", prog, depsfile);
+        }
+    } else {
+        insist(fwrite(ob.mem, 1, ob.len, fp) == ob.len, "fwrite(deps)");
+    }
+    if (depsdb && depsfile) {
+        obuf_add(&dbrec, "\n", 1);
+        depsdb_append(&dbrec);
+    }
+    free(dbrec.mem);
+    free(ob.mem);
+    free(sorted);
+}
+
+// Open/close the deps stream. Real files are written as a temp next to
+// the final name and renamed over it on close.
+static char *depstmp;
+
+// A die()/insist() exit between deps_open and deps_close would strand
+// the staging file in the watch tree, where it then pollutes every
+// later audit as a phantom new file; sweep it up on any exit path.
+static void
+deps_sweep(void)
+{
+    if (depstmp) {
+        (void)unlink(depstmp);
+    }
+}
+
+static int
+deps_open(void)
+{
+    static int registered;
+
+    if (!depsfile) {
+        fp = stdout;
+        return 0;
+    }
+    if (!registered) {
+        registered = 1;
+        (void)atexit(deps_sweep);
+    }
+    free(depstmp);
+    insist(asprintf(&depstmp, "%s.%ld.tmp", depsfile, (long)getpid()) != -1,
+            "asprintf()");
+    return (fp = fopen(depstmp, "w")) ? 0 : -1;
+}
+
+static void
+deps_close(void)
+{
+    if (depsfile) {
+        insist(fclose(fp) != EOF, depstmp);
+        if (deps_same) {
+            // Identical content: drop the staged copy and preserve the
+            // existing file's mtime.
+            (void)unlink(depstmp);
+            deps_same = 0;
+        } else {
+            insist(rename(depstmp, depsfile) != -1, depsfile);
+        }
+        free(depstmp);
+        depstmp = NULL;
+    }
+    fp = NULL;
+}
+
+/*
+ * JSON audit database. --json emits the same schema the Python pmaudit
+ * produces with its own --json option - hostname/base/cmd header, the
+ * db section with prereqs/intermediates/finals/unused, four timestamps
+ * and two sizes per path - so the C engine can stand in for pmaudit on
+ * whole-build audits without changing downstream consumers. Formatting
+ * mirrors pmaudit's dump: dicts are expanded with 2-space indents but
+ * each per-file record stays on a single line. Output goes through one
+ * large stdio buffer so a million-file database is a handful of writes.
+ */
+
+enum { JCAT_PREREQ, JCAT_INTER, JCAT_FINAL, JCAT_UNUSED };
+
+static int
+json_class(pathentry_s *p)
+{
+    if (verify_modified(p)) {
+        return JCAT_FINAL;
+    }
+    if (p->times1[0].tv_sec == -2L && p->times1[1].tv_sec == -1L) {
+        // Did not exist before the command.
+        return tscmp(&p->times2[1], &p->times2[0]) < 0 ?
+            JCAT_INTER : JCAT_FINAL;
+    }
+    if (tscmp(&p->times2[0], &p->times1[0]) > 0) {
+        if (tscmp(&p->times2[1], &p->times1[1]) > 0) {
+            return tscmp(&p->times2[1], &p->times2[0]) > 0 ?
+                JCAT_FINAL : JCAT_INTER;
+        }
+        return JCAT_PREREQ;
+    }
+    return tscmp(&p->times2[1], &p->times1[1]) > 0 ? JCAT_FINAL : JCAT_UNUSED;
+}
+
+static void
+json_str(FILE *jf, const char *s)
+{
+    fputc('"', jf);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', jf);
+            fputc(*s, jf);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(jf, "\\u%04x", (unsigned char)*s);
+        } else {
+            fputc(*s, jf);
+        }
+    }
+    fputc('"', jf);
+}
+
+static void
+json_timepair(FILE *jf, double t)
+{
+    char buf[32];
+    time_t sec = (time_t)t;
+    struct tm tm;
+
+    (void)gmtime_r(&sec, &tm);
+    (void)strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    fprintf(jf, "[\"%s.%06ldZ\", \"%.7f\"]", buf,
+            (long)((t - (double)sec) * 1e6), t);
+}
+
+// One per-file record on a single line, field shapes per category
+// matching pmaudit (unused post-times are "0", new pre-times are the
+// -2/-1 sentinels and the pre-size is null).
+static void
+json_val(FILE *jf, const pathentry_s *p, int cat)
+{
+    int isnew = p->size1 == -1;
+
+    fputs("{\"atime\": [", jf);
+    if (isnew) {
+        fprintf(jf, "\"-2\", \"%.7f\"", tsfloat(&p->times2[0]));
+    } else if (cat == JCAT_UNUSED) {
+        fprintf(jf, "\"%.7f\", \"0\"", tsfloat(&p->times1[0]));
+    } else {
+        fprintf(jf, "\"%.7f\", \"%.7f\"",
+                tsfloat(&p->times1[0]), tsfloat(&p->times2[0]));
+    }
+    fputs("], \"mtime\": [", jf);
+    if (isnew) {
+        fprintf(jf, "\"-1\", \"%.7f\"", tsfloat(&p->times2[1]));
+    } else if (cat == JCAT_UNUSED) {
+        fprintf(jf, "\"%.7f\", \"0\"", tsfloat(&p->times1[1]));
+    } else {
+        fprintf(jf, "\"%.7f\", \"%.7f\"",
+                tsfloat(&p->times1[1]), tsfloat(&p->times2[1]));
+    }
+    fputs("], \"size\": [", jf);
+    if (isnew) {
+        fprintf(jf, "null, %lld", (long long)p->size2);
+    } else if (cat == JCAT_UNUSED) {
+        fprintf(jf, "%lld, %lld", (long long)p->size1, (long long)p->size1);
+    } else {
+        fprintf(jf, "%lld, %lld", (long long)p->size1, (long long)p->size2);
+    }
+    fputs("]}", jf);
+}
+
+static void
+emit_json(const char *cmdstr, double reftime)
+{
+    static const char *catname[] = {
+        "prereqs", "intermediates", "finals", "unused"
+    };
+    char host[256] = "localhost", *cwd, *tmpjf;
+    FILE *jf;
+    void **sorted;
+    size_t i, n;
+    int cat, first;
+
+    sorted = audit_sorted(&n);
+    insist(asprintf(&tmpjf, "%s.%ld.tmp", jsonfile, (long)getpid()) != -1,
+            "asprintf()");
+    insist((jf = fopen(tmpjf, "w")) != NULL, tmpjf);
+    insist(setvbuf(jf, NULL, _IOFBF, 1 << 20) == 0, "setvbuf()");
+    (void)gethostname(host, sizeof(host) - 1);
+    insist((cwd = getcwd(NULL, 0)) != NULL, "getcwd()");
+
+    fputs("{\n  \"hostname\": ", jf);
+    json_str(jf, host);
+    fputs(",\n  \"base\": ", jf);
+    json_str(jf, cwd);
+    fputs(",\n  \"cmd\": ", jf);
+    json_str(jf, cmdstr);
+    fputs(",\n  \"final_cmd\": null", jf);
+    fputs(",\n  \"start_time\": ", jf);
+    json_timepair(jf, reftime);
+    fprintf(jf, ",\n  \"prior_count\": \"%zu\"", tab1.cnt);
+    fprintf(jf, ",\n  \"after_count\": \"%zu\"", n);
+    fputs(",\n  \"db\": {", jf);
+    for (cat = JCAT_PREREQ; cat <= JCAT_UNUSED; cat++) {
+        fprintf(jf, "%s\n    \"%s\": ",
+                cat == JCAT_PREREQ ? "" : ",", catname[cat]);
+        first = 1;
+        for (i = 0; i < n; i++) {
+            pathentry_s *p = sorted[i];
+
+            if (json_class(p) != cat) {
+                continue;
+            }
+            fputs(first ? "{\n      " : ",\n      ", jf);
+            first = 0;
+            json_str(jf, p->path);
+            fputs(": ", jf);
+            json_val(jf, p, cat);
+        }
+        fputs(first ? "{}" : "\n    }", jf);
+    }
+    fputs("\n  },\n  \"end_time\": ", jf);
+    json_timepair(jf, realtime());
+    fputs("\n}\n", jf);
+    insist(fclose(jf) == 0, tmpjf);
+    insist(rename(tmpjf, jsonfile) == 0, jsonfile);
+    free(tmpjf);
+    free(cwd);
+    free(sorted);
+}
+
+/*
+ * Baseline server. When make drives pmash once per recipe each
+ * invocation would pay two full tree walks even though almost nothing
+ * changes between recipes. Instead a long-lived "pmash -S <socket>"
+ * process holds tree1 in memory; the per-recipe pmash becomes a thin
+ * client which runs its command locally and asks the server to do the
+ * post-scan diff and fold the changes back into the baseline. A
+ * 10,000-recipe build thus pays one pre-scan total, and only touched
+ * files get re-primed between recipes.
+ */
+
+static void
+baseline_commit(void)
+{
+    size_t i;
+
+    // Untouched entries need no work; touched ones get re-primed in
+    // place so the next recipe starts from a clean relatime window.
+    for (i = 0; i < tab1.cap; i++) {
+        pathentry_s *p = tab1.slots[i], *own;
+
+        if (!p || p->gen != scan_gen) {
+            continue;
+        }
+        if (p->times2[0].tv_sec == p->times1[0].tv_sec &&
+                p->times2[0].tv_nsec == p->times1[0].tv_nsec &&
+                p->times2[1].tv_sec == p->times1[1].tv_sec &&
+                p->times2[1].tv_nsec == p->times1[1].tv_nsec) {
+            continue;
+        }
+        own = ino_find(p->dev, p->ino);
+        if (own && own != p && own->gen == scan_gen) {
+            // Another link owns this inode and will prime it; just
+            // record the times it will end up with.
+            prime_times(p, p->times2[1].tv_sec, p->times2[1].tv_nsec);
+            p->chash = own->chash;
+            p->size1 = p->size2;
+            continue;
+        }
+        if (verify_res != 0.0) {
+            p->chash = content_hash(p->path, p->size2);
+            prime_hard(p, p->path, &p->times2[1]);
+        } else {
+            prime(p, p->path, &p->times2[0], &p->times2[1]);
+        }
+        p->size1 = p->size2;
+    }
+    // New files are migrated into the baseline before their scratch
+    // storage is released wholesale.
+    for (i = 0; i < newtab.cap; i++) {
+        pathentry_s *p2 = newtab.slots[i], *p1;
+
+        if (!p2) {
+            continue;
+        }
+        p1 = arena_alloc(&perm_arena, sizeof(pathentry_s));
+        p1->path = arena_strdup(&perm_arena, p2->path);
+        p1->hash = p2->hash;
+        p1->gen = scan_gen;
+        p1->size1 = p2->size2;
+        p1->dev = p2->dev;
+        p1->ino = p2->ino;
+        if (verify_res != 0.0) {
+            p1->chash = content_hash(p1->path, p2->size2);
+            prime_hard(p1, p1->path, &p2->times2[1]);
+        } else {
+            prime(p1, p1->path, &p2->times2[0], &p2->times2[1]);
+        }
+        if (!ino_find(p1->dev, p1->ino)) {
+            ino_insert(p1->dev, p1->ino, p1);
+        }
+        tab_insert(&tab1, p1);
+    }
+    tab_reset(&newtab);
+    arena_reset(&scratch_arena);
+
+    // Directories the post-scan descended into have had their atimes
+    // disturbed (by the recipe or by our own readdirs); re-prime them
+    // so the next round's pruning decisions stay sound.
+    if (prune_dirs) {
+        for (i = 0; i < dirtab.cap; i++) {
+            direntry_s *d = dirtab.slots[i];
+
+            if (d && d->gen == scan_gen) {
+                dir_prime(d->path);
+            }
+        }
+    }
+}
+
+/*
+ * Binary baseline snapshots. --snapshot serializes the baseline (the
+ * tab1 path set with its times1 pairs plus the directory stat records)
+ * into a compact format which a later run mmaps read-only instead of
+ * re-walking the tree: entry path pointers aim straight into the
+ * mapped blob. Validation is cheap - every recorded directory must
+ * still have the same mtime, which catches any create/delete anywhere
+ * in the tree - and any mismatch falls back to a full pre-scan.
+ * Consecutive recipes can chain through one snapshot file since each
+ * run saves its committed post-state for the next.
+ */
+
+typedef struct {
+    char magic[8];
+    uint64_t nents, ndirs, blobsize;
+} snaphdr_s;
+
+typedef struct {
+    int64_t asec, ansec, msec, mnsec;   /* times1 */
+    int64_t size;
+    uint64_t chash;
+    uint64_t dev, ino;
+    uint64_t hash, pathoff;
+} snapent_s;
+
+typedef struct {
+    int64_t asec, ansec, msec, mnsec;
+    uint64_t hash, pathoff;
+} snapdir_s;
+
+static const char snapmagic[8] = "pmsnap04";
+
+static int
+snap_load(const char *snapfile)
+{
+    int fd;
+    char *map, *blob;
+    struct stat st;
+    snaphdr_s *hdr;
+    snapdir_s *sd;
+    snapent_s *se;
+    uint64_t i;
+
+    if ((fd = open(snapfile, O_RDONLY)) == -1) {
+        return -1;
+    }
+    insist(fstat(fd, &st) != -1, snapfile);
+    if ((size_t)st.st_size < sizeof(snaphdr_s)) {
+        (void)close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    (void)close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    hdr = (snaphdr_s *)map;
+    if (memcmp(hdr->magic, snapmagic, sizeof(snapmagic)) ||
+            sizeof(snaphdr_s) + hdr->ndirs * sizeof(snapdir_s) +
+            hdr->nents * sizeof(snapent_s) + hdr->blobsize !=
+            (uint64_t)st.st_size ||
+            (hdr->blobsize && map[st.st_size - 1] != '\0')) {
+        (void)munmap(map, st.st_size);
+        return -1;
+    }
+    sd = (snapdir_s *)(map + sizeof(snaphdr_s));
+    se = (snapent_s *)(sd + hdr->ndirs);
+    blob = (char *)(se + hdr->nents);
+
+    for (i = 0; i < hdr->ndirs; i++) {
+        struct stat dst;
+
+        if (sd[i].pathoff >= hdr->blobsize ||
+                lstat(blob + sd[i].pathoff, &dst) == -1 ||
+                dst.st_mtime != sd[i].msec ||
+                dst.st_mtim.tv_nsec != sd[i].mnsec) {
+            (void)munmap(map, st.st_size);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < hdr->ndirs; i++) {
+        direntry_s *d = arena_alloc(&perm_arena, sizeof(direntry_s));
+
+        d->path = blob + sd[i].pathoff;
+        d->hash = sd[i].hash;
+        d->dtimes[0].tv_sec = sd[i].asec;
+        d->dtimes[0].tv_nsec = sd[i].ansec;
+        d->dtimes[1].tv_sec = sd[i].msec;
+        d->dtimes[1].tv_nsec = sd[i].mnsec;
+        tab_insert(&dirtab, d);
+    }
+    for (i = 0; i < hdr->nents; i++) {
+        pathentry_s *p;
+
+        if (se[i].pathoff >= hdr->blobsize) {
+            die("corrupt snapshot");
+        }
+        p = arena_alloc(&perm_arena, sizeof(pathentry_s));
+        p->path = blob + se[i].pathoff;
+        p->hash = se[i].hash;
+        p->times1[0].tv_sec = se[i].asec;
+        p->times1[0].tv_nsec = se[i].ansec;
+        p->times1[1].tv_sec = se[i].msec;
+        p->times1[1].tv_nsec = se[i].mnsec;
+        p->size1 = se[i].size;
+        p->chash = se[i].chash;
+        p->dev = se[i].dev;
+        p->ino = se[i].ino;
+        if (!ino_find(p->dev, p->ino)) {
+            ino_insert(p->dev, p->ino, p);
+        }
+        tab_insert(&tab1, p);
+    }
+    return 0;
+}
+
+static void
+snap_save(const char *snapfile)
+{
+    char *tmpf;
+    FILE *sf;
+    snaphdr_s hdr;
+    uint64_t off = 0;
+    size_t i;
+
+    memcpy(hdr.magic, snapmagic, sizeof(snapmagic));
+    hdr.nents = tab1.cnt;
+    hdr.ndirs = dirtab.cnt;
+    hdr.blobsize = 0;   /* filled below */
+
+    insist(asprintf(&tmpf, "%s.%ld.tmp", snapfile, (long)getpid()) != -1,
+            "asprintf()");
+    insist((sf = fopen(tmpf, "w")) != NULL, tmpf);
+
+    // Offsets are assigned in slot order on the first pass and the
+    // blob is emitted in the same order on the second.
+    for (i = 0; i < dirtab.cap; i++) {
+        if (dirtab.slots[i]) {
+            hdr.blobsize += strlen(((direntry_s *)dirtab.slots[i])->path) + 1;
+        }
+    }
+    for (i = 0; i < tab1.cap; i++) {
+        if (tab1.slots[i]) {
+            hdr.blobsize += strlen(((pathentry_s *)tab1.slots[i])->path) + 1;
+        }
+    }
+    insist(fwrite(&hdr, sizeof(hdr), 1, sf) == 1, tmpf);
+    for (i = 0; i < dirtab.cap; i++) {
+        direntry_s *d = dirtab.slots[i];
+        snapdir_s sd;
+
+        if (!d) {
+            continue;
+        }
+        sd.asec = d->dtimes[0].tv_sec;
+        sd.ansec = d->dtimes[0].tv_nsec;
+        sd.msec = d->dtimes[1].tv_sec;
+        sd.mnsec = d->dtimes[1].tv_nsec;
+        sd.hash = d->hash;
+        sd.pathoff = off;
+        off += strlen(d->path) + 1;
+        insist(fwrite(&sd, sizeof(sd), 1, sf) == 1, tmpf);
+    }
+    for (i = 0; i < tab1.cap; i++) {
+        pathentry_s *p = tab1.slots[i];
+        snapent_s se;
+
+        if (!p) {
+            continue;
+        }
+        se.asec = p->times1[0].tv_sec;
+        se.ansec = p->times1[0].tv_nsec;
+        se.msec = p->times1[1].tv_sec;
+        se.mnsec = p->times1[1].tv_nsec;
+        se.size = p->size1;
+        se.chash = p->chash;
+        se.dev = p->dev;
+        se.ino = p->ino;
+        se.hash = p->hash;
+        se.pathoff = off;
+        off += strlen(p->path) + 1;
+        insist(fwrite(&se, sizeof(se), 1, sf) == 1, tmpf);
+    }
+    for (i = 0; i < dirtab.cap; i++) {
+        direntry_s *d = dirtab.slots[i];
+
+        if (d) {
+            insist(fwrite(d->path, strlen(d->path) + 1, 1, sf) == 1, tmpf);
+        }
+    }
+    for (i = 0; i < tab1.cap; i++) {
+        pathentry_s *p = tab1.slots[i];
+
+        if (p) {
+            insist(fwrite(p->path, strlen(p->path) + 1, 1, sf) == 1, tmpf);
+        }
+    }
+    insist(fclose(sf) != EOF, tmpf);
+    insist(rename(tmpf, snapfile) != -1, snapfile);
+    free(tmpf);
+
+    // The staging and rename above just bumped the snapfile's own
+    // parent directory times behind the record serialized a moment
+    // ago; put the directory back the way the snapshot says it was,
+    // or the snapshot could never validate inside the watch tree.
+    {
+        char *dir, *slash;
+        const char *key;
+        direntry_s *d;
+
+        insist((dir = strdup(snapfile)) != NULL, "strdup()");
+        if ((slash = strrchr(dir, '/'))) {
+            *slash = '\0';
+        } else {
+            dir[0] = '.';
+            dir[1] = '\0';
+        }
+        key = (dir[0] == '.' && dir[1] == '/') ? dir + 2 : dir;
+        if ((d = tab_find(&dirtab, key, pathhash(key)))) {
+            (void)utimensat(AT_FDCWD, dir, d->dtimes, 0);
+        }
+        free(dir);
+    }
+}
+
+static void
+serve_audit(const char *dfile, const char *watchdirs)
+{
+    double tstamp;
+
+    depsfile = strcmp(dfile, "-") ? strdup(dfile) : NULL;
+    prq_count = 0;
+    if (deps_open() == -1) {
+        fprintf(stderr, "%s: Warning: skipping %s: %s\n",
+                prog, depsfile, strerror(errno));
+    }
+    tstamp = monotime();
+    post_scan(watchdirs);
+    stats.post_walk = monotime() - tstamp;
+    tstamp = monotime();
+    if (fp) {
+        emit_deps();
+        deps_close();
+    }
+    baseline_commit();
+    stats.output = monotime() - tstamp;
+    if (show_stats || verbosity > 1) {
+        stats_emit();
+    }
+    free(depsfile);
+    depsfile = NULL;
+}
+
+static void
+serve(const char *sockpath, const char *watchdirs)
+{
+    int lfd, cfd;
+    struct sockaddr_un sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    insist(strlen(sockpath) < sizeof(sa.sun_path), "socket path too long");
+    strcpy(sa.sun_path, sockpath);
+    (void)unlink(sockpath);
+    insist((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1, "socket()");
+    insist(bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) != -1, sockpath);
+    insist(listen(lfd, 64) != -1, sockpath);
+
+    pre_scan(watchdirs);
+
+    // Clients are served one at a time to completion, which is what
+    // serializes recipes against the shared baseline.
+    while ((cfd = accept(lfd, NULL, NULL)) != -1) {
+        FILE *cl;
+        char line[4096];
+
+        if ((cl = fdopen(cfd, "r+")) == NULL) {
+            (void)close(cfd);
+            continue;
+        }
+        while (fgets(line, sizeof(line), cl)) {
+            line[strcspn(line, "\n")] = '\0';
+            if (!strcmp(line, "begin")) {
+                fputs("ok\n", cl);
+                fflush(cl);
+            } else if (!strncmp(line, "audit ", 6)) {
+                serve_audit(line + 6, watchdirs);
+                fputs("ok\n", cl);
+                fflush(cl);
+            } else if (!strcmp(line, "quit")) {
+                fclose(cl);
+                (void)close(lfd);
+                (void)unlink(sockpath);
+                return;
+            }
+        }
+        fclose(cl);
+    }
+}
+
+static int
+client(const char *sockpath, const char *cmdstr)
+{
+    int fd, rc = EXIT_SUCCESS;
+    FILE *srv;
+    char line[64];
+    struct sockaddr_un sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    insist(strlen(sockpath) < sizeof(sa.sun_path), "socket path too long");
+    strcpy(sa.sun_path, sockpath);
+    insist((fd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1, "socket()");
+    insist(connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != -1, sockpath);
+    insist((srv = fdopen(fd, "r+")) != NULL, "fdopen()");
+
+    // The "begin" handshake blocks until the server has finished
+    // folding the previous recipe into the baseline.
+    fputs("begin\n", srv);
+    fflush(srv);
+    insist(fgets(line, sizeof(line), srv) != NULL, "server handshake");
+
+    if (run_cmd(cmdstr)) {
+        rc = EXIT_FAILURE;
+    }
+
+    fprintf(srv, "audit %s\n", depsfile ? depsfile : "-");
+    fflush(srv);
+    insist(fgets(line, sizeof(line), srv) != NULL, "server audit");
+    fclose(srv);
+
+    return rc;
+}
+
+/*
+ * Fanotify engine (Linux only). Rather than sampling timestamps before
+ * and after the command, register fanotify marks on the mounts holding
+ * the watch directories and collect the access/modify event stream
+ * while the command runs. The prereq set falls straight out of the
+ * events so both full tree walks disappear, and there's no dependence
+ * on atime semantics at all. Needs CAP_SYS_ADMIN; when fanotify setup
+ * fails we warn and fall back to the timestamp engine.
+ */
+
+enum { ENGINE_TIMES, ENGINE_FANOTIFY, ENGINE_PRELOAD };
+
+static int engine = ENGINE_TIMES;
+
+typedef struct {
+    const char *path;
+    uint64_t hash;
+    int rd, wr;
+} access_s;
+
+static pathtab_s acctab;
+
+static access_s *
+accfind(const char *path)
+{
+    access_s *a;
+    uint64_t hash = pathhash(path);
+
+    if ((a = tab_find(&acctab, path, hash))) {
+        return a;
+    }
+    a = arena_alloc(&scratch_arena, sizeof(access_s));
+    a->path = arena_strdup(&scratch_arena, path);
+    a->hash = hash;
+    tab_insert(&acctab, a);
+    return a;
+}
+
+// Synthesize a prereq-shaped new-file entry for each read-only access
+// so the normal emit path can be reused as-is.
+static void
+access_merge(void)
+{
+    size_t i;
+
+    for (i = 0; i < acctab.cap; i++) {
+        access_s *a = acctab.slots[i];
+        pathentry_s *p;
+
+        if (!a || !a->rd || a->wr) {
+            continue;
+        }
+        p = arena_alloc(&scratch_arena, sizeof(pathentry_s));
+        p->path = a->path;
+        p->hash = a->hash;
+        p->times2[0].tv_sec = 1;    /* atime "moved", mtime didn't */
+        tab_insert(&newtab, p);
+    }
+}
+
+#ifdef __linux__
+static int
+fanotify_audit(const char *watchdirs, const char *cmdstr)
+{
+    int fanfd, rc = EXIT_SUCCESS, status = 0;
+    char *path, *cwd, *wabs[64];
+    unsigned i, nw = 0;
+    size_t cwdlen;
+    pid_t pid;
+
+    if ((fanfd = fanotify_init(FAN_CLASS_NOTIF|FAN_CLOEXEC|FAN_NONBLOCK,
+                    O_RDONLY|O_LARGEFILE|O_CLOEXEC)) == -1) {
+        return -1;
+    }
+    for (path = strtok(strdup(watchdirs), ","); path; path = strtok(NULL, ",")) {
+        if (fanotify_mark(fanfd, FAN_MARK_ADD|FAN_MARK_MOUNT,
+                    FAN_ACCESS|FAN_MODIFY|FAN_CLOSE_WRITE,
+                    AT_FDCWD, path) == -1) {
+            (void)close(fanfd);
+            return -1;
+        }
+        // The mark covers the whole mount so keep the resolved watch
+        // dirs around to filter the event stream back down to scope.
+        insist(nw < sizeof(wabs)/sizeof(wabs[0]), "too many watch dirs");
+        insist((wabs[nw] = realpath(path, NULL)) != NULL, path);
+        nw++;
+    }
+    insist((cwd = getcwd(NULL, 0)) != NULL, "getcwd()");
+    cwdlen = strlen(cwd);
+
+    insist((pid = fork()) != -1, "fork()");
+    if (pid == 0) {
+        (void)close(fanfd);
+        execl("/bin/sh", "sh", "-c", cmdstr, (char *)NULL);
+        _exit(127);
+    }
+
+    while (1) {
+        struct pollfd pfd;
+        char evbuf[8192];
+        ssize_t len;
+        int done;
+
+        if (pid && waitpid(pid, &status, WNOHANG) == pid) {
+            rc = (WIFEXITED(status) && WEXITSTATUS(status) == 0) ?
+                    EXIT_SUCCESS : EXIT_FAILURE;
+            pid = 0;
+        }
+        done = !pid;
+        pfd.fd = fanfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, done ? 0 : 100) <= 0) {
+            if (done) {
+                break;
+            }
+            continue;
+        }
+        while ((len = read(fanfd, evbuf, sizeof(evbuf))) > 0) {
+            struct fanotify_event_metadata *md = (void *)evbuf;
+
+            for (; FAN_EVENT_OK(md, len); md = FAN_EVENT_NEXT(md, len)) {
+                char lnk[64], fpath[PATH_MAX];
+                ssize_t n;
+
+                if (md->fd < 0) {
+                    continue;
+                }
+                snprintf(lnk, sizeof(lnk), "/proc/self/fd/%d", md->fd);
+                if ((n = readlink(lnk, fpath, sizeof(fpath) - 1)) > 0 &&
+                        md->pid != getpid()) {
+                    fpath[n] = '\0';
+                    for (i = 0; i < nw; i++) {
+                        size_t l = strlen(wabs[i]);
+
+                        if (!strncmp(fpath, wabs[i], l) &&
+                                (fpath[l] == '/' || fpath[l] == '\0')) {
+                            break;
+                        }
+                    }
+                    if (i < nw) {
+                        const char *rel = fpath;
+                        access_s *a;
+
+                        if (!strncmp(fpath, cwd, cwdlen) &&
+                                fpath[cwdlen] == '/') {
+                            rel = fpath + cwdlen + 1;
+                        }
+                        if (excluded(rel)) {
+                            (void)close(md->fd);
+                            continue;
+                        }
+                        a = accfind(rel);
+                        if (md->mask & FAN_ACCESS) {
+                            a->rd = 1;
+                        }
+                        if (md->mask & (FAN_MODIFY|FAN_CLOSE_WRITE)) {
+                            a->wr = 1;
+                        }
+                    }
+                }
+                (void)close(md->fd);
+            }
+        }
+    }
+    (void)close(fanfd);
+
+    access_merge();
+
+    return rc;
+}
+#else
+static int
+fanotify_audit(const char *watchdirs, const char *cmdstr)
+{
+    (void)watchdirs;
+    (void)cmdstr;
+    return -1;
+}
+#endif
+
+/*
+ * Overlay sandbox. With -O the audited command runs in a private
+ * user+mount namespace with an overlayfs mounted over each watch
+ * directory: the command sees the normal tree but every write lands in
+ * a scratch upper layer, so concurrent recipes can't contaminate each
+ * other's audits. After the command exits the upper layer - which is
+ * also the exact target set, including files written and then removed,
+ * which timestamps alone can't see - is merged back into the real tree
+ * with timestamps intact, and the normal post-scan diff classifies as
+ * usual. One caveat: overlayfs opens lower-layer files O_NOATIME, so
+ * reads through the overlay leave no atime trace anywhere - the
+ * timestamp engine cannot see prereqs under -O. Pair it with the
+ * preload engine (-O -E preload), which reports reads over a pipe and
+ * doesn't care about atimes; -O alone still yields exact targets and
+ * isolation but an empty prereq list, and says so. Needs a kernel that
+ * allows unprivileged overlay mounts (5.11+); otherwise we warn and
+ * run the command unconfined.
+ */
+
+static int overlay;
+
+#ifdef __linux__
+
+static void
+write_str(const char *path, const char *str)
+{
+    int fd;
+
+    if ((fd = open(path, O_WRONLY)) != -1) {
+        (void)!write(fd, str, strlen(str));
+        (void)close(fd);
+    }
+}
+
+// Child-side setup: enter private user+mount namespaces and mount one
+// overlay per watch dir. Any failure means "no sandbox here" and is
+// reported over the status pipe so the parent can run unconfined.
+static int
+ov_enter(const char *watchdirs, const char *scratch, const char *cwd)
+{
+    char *dirs, *path, map[64];
+    long uid = (long)getuid(), gid = (long)getgid();
+    int n = 0;
 
-static void *tree1, *tree2;
+    if (unshare(CLONE_NEWUSER|CLONE_NEWNS) == -1) {
+        return -1;
+    }
+    // Map our pre-unshare uid/gid to themselves so ownership looks
+    // unchanged inside the namespace.
+    write_str("/proc/self/setgroups", "deny");
+    snprintf(map, sizeof(map), "%ld %ld 1", uid, uid);
+    write_str("/proc/self/uid_map", map);
+    snprintf(map, sizeof(map), "%ld %ld 1", gid, gid);
+    write_str("/proc/self/gid_map", map);
+    // Keep our mounts from propagating back to the parent namespace.
+    if (mount(NULL, "/", NULL, MS_REC|MS_PRIVATE, NULL) == -1) {
+        return -1;
+    }
+    insist((dirs = strdup(watchdirs)) != NULL, "strdup()");
+    for (path = strtok(dirs, ","); path; path = strtok(NULL, ","), n++) {
+        char real[PATH_MAX], *opt;
 
-static FILE *fp;
-static char *depsfile;
-static unsigned verbosity;
-static unsigned prq_count;
+        if (!realpath(path, real)) {
+            return -1;
+        }
+        insist(asprintf(&opt, "lowerdir=%s,upperdir=%s/up%d,workdir=%s/wk%d",
+                    real, scratch, n, scratch, n) != -1, "asprintf()");
+        if (mount("overlay", real, "overlay", 0, opt) == -1) {
+            return -1;
+        }
+        free(opt);
+    }
+    free(dirs);
+    // Re-enter the cwd so relative paths resolve through the overlay.
+    return chdir(cwd);
+}
 
+// Copy one upper-layer file over its lower original, timestamps and
+// mode included, so the post-scan diff sees it exactly as if it had
+// been written in place.
 static void
-usage(int rc)
+ov_copyfile(const char *src, const char *dst, const struct stat *st)
 {
-    FILE *f = (rc == EXIT_SUCCESS) ? stdout : stderr;
-    const char *fmt = "   %-18s %s\n";
+    char buf[65536];
+    struct timespec times[2];
+    ssize_t n;
+    int in, out;
 
-    fprintf(f, "Usage: %s -c <cmd> [-d <depsfile>] [-W dir[,dir,...]]\n", prog);
-    fprintf(f, fmt, "-h/--help", "Print this usage summary");
-    fprintf(f, fmt, "-c/--command", "Command to invoke");
-    fprintf(f, fmt, "-d/--depsfile", "File path to save dependency list");
-    fprintf(f, fmt, "-e/--errexit", "Exit on first error");
-    fprintf(f, fmt, "-V/--verbose", "Bump verbosity mode");
-    fprintf(f, fmt, "-W/--watch", "Directories to monitor (default='.')");
-    fprintf(f, "\nEXAMPLES:\n\n");
-    fprintf(f, "Compile foo.o leaving prereq data in foo.o.d:\n\n");
-    fprintf(f, "    %s --depsfile=foo.o.d -c 'gcc -c foo.c'\n", prog);
-    exit(rc);
+    if ((in = open(src, O_RDONLY)) == -1) {
+        return;
+    }
+    if ((out = open(dst, O_WRONLY|O_CREAT|O_TRUNC, st->st_mode & 07777))
+            == -1) {
+        (void)close(in);
+        return;
+    }
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        insist(write(out, buf, n) == n, dst);
+    }
+    (void)close(in);
+    (void)close(out);
+    times[0] = st->st_atim;
+    times[1] = st->st_mtim;
+    (void)utimensat(AT_FDCWD, dst, times, 0);
 }
 
-void
-die(char *msg)
+// Merge the upper layer back into the real tree. Character device 0:0
+// entries are overlayfs whiteouts marking deletions.
+static void
+ov_merge(const char *upper, const char *lower)
 {
-    fprintf(stderr, "%s: Error: %s\n", prog, msg);
-    exit(EXIT_FAILURE);
+    DIR *d;
+    struct dirent *de;
+
+    if ((d = opendir(upper)) == NULL) {
+        return;
+    }
+    while ((de = readdir(d))) {
+        char *up, *lp;
+        struct stat st;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        insist(asprintf(&up, "%s/%s", upper, de->d_name) != -1, "asprintf()");
+        if (!strcmp(lower, ".")) {
+            insist(asprintf(&lp, "%s", de->d_name) != -1, "asprintf()");
+        } else {
+            insist(asprintf(&lp, "%s/%s", lower, de->d_name) != -1,
+                    "asprintf()");
+        }
+        if (lstat(up, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                (void)mkdir(lp, st.st_mode & 07777);
+                ov_merge(up, lp);
+            } else if (S_ISCHR(st.st_mode) && st.st_rdev == 0) {
+                (void)unlink(lp);
+            } else if (S_ISREG(st.st_mode)) {
+                if (verbosity) {
+                    fprintf(stderr, "%s: overlay target: %s\n", prog, lp);
+                }
+                ov_copyfile(up, lp, &st);
+            } else if (S_ISLNK(st.st_mode)) {
+                char tgt[PATH_MAX];
+                ssize_t len;
+
+                if ((len = readlink(up, tgt, sizeof(tgt) - 1)) > 0) {
+                    tgt[len] = '\0';
+                    (void)unlink(lp);
+                    (void)symlink(tgt, lp);
+                }
+            }
+        }
+        free(up);
+        free(lp);
+    }
+    (void)closedir(d);
 }
 
-void
-insist(int success, const char *term)
+static void
+ov_rmtree(const char *dir)
 {
-    if (!success) {
-        fprintf(stderr, "%s: Error: %s: %s\n", prog, term, strerror(errno));
-        exit(EXIT_FAILURE);
+    DIR *d;
+    struct dirent *de;
+
+    if ((d = opendir(dir)) == NULL) {
+        return;
+    }
+    while ((de = readdir(d))) {
+        char *path;
+        struct stat st;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        insist(asprintf(&path, "%s/%s", dir, de->d_name) != -1, "asprintf()");
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            ov_rmtree(path);
+        } else {
+            (void)unlink(path);
+        }
+        free(path);
     }
+    (void)closedir(d);
+    (void)rmdir(dir);
 }
 
-static int
-pathcmp(const void *pa, const void *pb)
+// Create the scratch area with one upper/work dir pair per watch dir.
+// Returns NULL if no scratch can be had (sandbox unavailable).
+static char *
+ov_setup(const char *watchdirs)
 {
-    return strcmp(((pathentry_s *)pa)->path, ((pathentry_s *)pb)->path);
+    char *scratch, *dirs, *path;
+    int n = 0;
+
+    insist(asprintf(&scratch, "%s/pmash.%ld.ov",
+                getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp",
+                (long)getpid()) != -1, "asprintf()");
+    if (mkdir(scratch, 0700) == -1) {
+        free(scratch);
+        return NULL;
+    }
+    insist((dirs = strdup(watchdirs)) != NULL, "strdup()");
+    for (path = strtok(dirs, ","); path; path = strtok(NULL, ","), n++) {
+        char *sub;
+
+        insist(asprintf(&sub, "%s/up%d", scratch, n) != -1, "asprintf()");
+        insist(mkdir(sub, 0700) == 0, sub);
+        free(sub);
+        insist(asprintf(&sub, "%s/wk%d", scratch, n) != -1, "asprintf()");
+        insist(mkdir(sub, 0700) == 0, sub);
+        free(sub);
+    }
+    free(dirs);
+    return scratch;
 }
 
-static int
-nftw_pre_callback(const char *fpath, const struct stat *sb,
-        int tflag, struct FTW *ftwbuf)
+// Merge every upper layer back (unless watchdirs is NULL, meaning the
+// sandbox never came up) and remove the scratch area.
+static void
+ov_finish(char *scratch, const char *watchdirs)
 {
-    pathentry_s *p1;
+    char *dirs, *path;
+    int n = 0;
 
-    (void)ftwbuf; /* unused */
+    if (watchdirs) {
+        insist((dirs = strdup(watchdirs)) != NULL, "strdup()");
+        for (path = strtok(dirs, ","); path;
+                path = strtok(NULL, ","), n++) {
+            char *up;
 
-    /* We're only interested in files. */
-    if (tflag != FTW_F) {
-        return 0;
+            insist(asprintf(&up, "%s/up%d", scratch, n) != -1, "asprintf()");
+            ov_merge(up, path);
+            free(up);
+        }
+        free(dirs);
     }
+    ov_rmtree(scratch);
+    free(scratch);
+}
 
-    if (strstr(fpath, ".git") || strstr(fpath, ".svn") || strstr(fpath, ".swp")) {
-        return 0;
+// Run the command sandboxed. Returns its wait status, or -1 if the
+// sandbox could not be set up on this kernel.
+static int
+overlay_run(const char *watchdirs, const char *cmdstr)
+{
+    char *scratch, *cwd, err;
+    int pfd[2], status = 0;
+    pid_t pid;
+
+    if ((scratch = ov_setup(watchdirs)) == NULL) {
+        return -1;
     }
+    insist((cwd = getcwd(NULL, 0)) != NULL, "getcwd()");
+    insist(pipe2(pfd, O_CLOEXEC) == 0, "pipe2()");
 
-    if (fpath[0] == '.' && fpath[1] == '/') {
-        fpath += 2;
+    insist((pid = fork()) != -1, "fork()");
+    if (pid == 0) {
+        (void)close(pfd[0]);
+        if (ov_enter(watchdirs, scratch, cwd) == -1) {
+            (void)!write(pfd[1], "x", 1);
+            _exit(127);
+        }
+        execl("/bin/sh", "sh", "-c", cmdstr, (char *)NULL);
+        (void)!write(pfd[1], "x", 1);
+        _exit(127);
+    }
+    (void)close(pfd[1]);
+    insist(waitpid(pid, &status, 0) == pid, "waitpid()");
+    if (read(pfd[0], &err, 1) == 1) {
+        // Setup failed before the command ever ran.
+        (void)close(pfd[0]);
+        ov_finish(scratch, NULL);
+        free(cwd);
+        return -1;
     }
+    (void)close(pfd[0]);
 
-    // Record atimes/mtimes but only after setting atimes behind mtimes
-    // for "relatime" reasons.
-    insist((p1 = calloc(sizeof(pathentry_s), 1)) != NULL, "calloc(sizeof(pathentry_s))");
-    p1->path = strdup(fpath);
-    p1->times1[0].tv_sec = sb->st_mtime - 1;
-    p1->times1[0].tv_nsec = 0L;
-    p1->times1[1].tv_sec = sb->st_mtime;
-    p1->times1[1].tv_nsec = sb->st_mtim.tv_nsec;
-    insist(utimensat(AT_FDCWD, fpath, p1->times1, 0) != -1, fpath);
-    insist(tsearch((const void *)p1, &tree1, pathcmp) != NULL, "tsearch(&pre)");
+    ov_finish(scratch, watchdirs);
+    free(cwd);
+    return status;
+}
 
-    return 0;
+#else
+
+static int
+ov_enter(const char *watchdirs, const char *scratch, const char *cwd)
+{
+    (void)watchdirs;
+    (void)scratch;
+    (void)cwd;
+    return -1;
+}
+
+static char *
+ov_setup(const char *watchdirs)
+{
+    (void)watchdirs;
+    return NULL;
+}
+
+static void
+ov_finish(char *scratch, const char *watchdirs)
+{
+    (void)scratch;
+    (void)watchdirs;
 }
 
 static int
-nftw_post_callback(const char *fpath, const struct stat *sb,
-        int tflag, struct FTW *ftwbuf)
+overlay_run(const char *watchdirs, const char *cmdstr)
 {
-    const void *px;
-    pathentry_s *p1, *p2;
+    (void)watchdirs;
+    (void)cmdstr;
+    return -1;
+}
+#endif
 
-    (void)ftwbuf; /* unused */
+/*
+ * LD_PRELOAD engine. libpmash.so is injected into the audited command
+ * and streams one "R <path>"/"W <path>" line per open-family call back
+ * over a pipe, so no scan of any kind is needed and per-recipe cost is
+ * proportional to the files actually touched. The library is found
+ * next to the pmash binary by default ($PMASH_PRELOAD overrides). The
+ * line stream funnels into the same access table the fanotify engine
+ * uses, so classification and emission are shared.
+ */
 
-    /* We're only interested in files. */
-    if (tflag != FTW_F) {
-        return 0;
+static int
+preload_audit(const char *watchdirs, const char *cmdstr)
+{
+    char *lib, *cwd, *line = NULL, *ovscratch = NULL, libbuf[PATH_MAX];
+    size_t cwdlen, linesz = 0;
+    ssize_t len;
+    FILE *in;
+    int pfd[2], status = 0, rc = EXIT_SUCCESS, ovfailed = 0;
+    pid_t pid;
+
+    if (!(lib = getenv("PMASH_PRELOAD"))) {
+        // Default to libpmash.so alongside the running binary.
+        if ((len = readlink("/proc/self/exe", libbuf,
+                        sizeof(libbuf) - 16)) <= 0) {
+            return -1;
+        }
+        libbuf[len] = '\0';
+        strcpy(strrchr(libbuf, '/') + 1, "libpmash.so");
+        lib = libbuf;
+    }
+    if (access(lib, R_OK) == -1) {
+        return -1;
+    }
+    insist((cwd = getcwd(NULL, 0)) != NULL, "getcwd()");
+    cwdlen = strlen(cwd);
+    if (overlay && (ovscratch = ov_setup(watchdirs)) == NULL) {
+        fprintf(stderr, "%s: Warning: overlay sandbox unavailable, "
+                "running unconfined\n", prog);
     }
+    insist(pipe(pfd) == 0, "pipe()");
 
-    if (strstr(fpath, ".git") || strstr(fpath, ".svn") || strstr(fpath, ".swp")) {
-        return 0;
+    insist((pid = fork()) != -1, "fork()");
+    if (pid == 0) {
+        char fdstr[16];
+
+        (void)close(pfd[0]);
+        // The sandbox is best-effort here: reads come over the pipe
+        // either way, so on failure just report it and run unconfined.
+        if (ovscratch && ov_enter(watchdirs, ovscratch, cwd) == -1) {
+            (void)!write(pfd[1], "E overlay\n", 10);
+        }
+        snprintf(fdstr, sizeof(fdstr), "%d", pfd[1]);
+        insist(setenv("PMASH_FD", fdstr, 1) == 0, "setenv()");
+        insist(setenv("LD_PRELOAD", lib, 1) == 0, "setenv()");
+        execl("/bin/sh", "sh", "-c", cmdstr, (char *)NULL);
+        _exit(127);
     }
+    (void)close(pfd[1]);
+    insist((in = fdopen(pfd[0], "r")) != NULL, "fdopen()");
+
+    // The pipe drains while the command runs; EOF arrives when the
+    // last writer (the recipe and all its children) has exited.
+    while ((len = getline(&line, &linesz, in)) > 0) {
+        const char *fpath = line + 2, *tok;
+        char *dirs, *save;
+        access_s *a;
+        int inscope = 0;
+
+        line[len - 1] = '\0';
+        if (line[0] == 'E') {
+            fprintf(stderr, "%s: Warning: overlay sandbox unavailable, "
+                    "running unconfined\n", prog);
+            ovfailed = 1;
+            continue;
+        }
+        if (len < 3 || (line[0] != 'R' && line[0] != 'W')) {
+            continue;
+        }
+        if (fpath[0] == '/') {
+            // Absolute paths are only in scope below our own cwd.
+            if (strncmp(fpath, cwd, cwdlen) || fpath[cwdlen] != '/') {
+                continue;
+            }
+            fpath += cwdlen + 1;
+        }
+        if (fpath[0] == '.' && fpath[1] == '/') {
+            fpath += 2;
+        }
+        dirs = strdup(watchdirs);
+        for (tok = strtok_r(dirs, ",", &save); tok;
+                tok = strtok_r(NULL, ",", &save)) {
+            size_t l = strlen(tok);
 
-    if (fpath[0] == '.' && fpath[1] == '/') {
-        fpath += 2;
+            if (!strcmp(tok, ".") ||
+                    (!strncmp(fpath, tok, l) && fpath[l] == '/')) {
+                inscope = 1;
+                break;
+            }
+        }
+        free(dirs);
+        if (!inscope || excluded(fpath)) {
+            continue;
+        }
+        a = accfind(fpath);
+        if (line[0] == 'R') {
+            a->rd = 1;
+        } else {
+            a->wr = 1;
+        }
     }
+    free(line);
+    (void)fclose(in);
+    insist(waitpid(pid, &status, 0) == pid, "waitpid()");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        rc = EXIT_FAILURE;
+    }
+    if (ovscratch) {
+        ov_finish(ovscratch, ovfailed ? NULL : watchdirs);
+    }
+    free(cwd);
+
+    access_merge();
+
+    return rc;
+}
+
+/*
+ * Parallel-build scoping. A -j build can't share one whole-tree audit,
+ * but concurrent pmash instances whose scans are restricted to
+ * disjoint directory scopes don't interfere at all, and those with
+ * overlapping scopes just need to serialize against each other. The
+ * scope map is a file of "glob-pattern dir[,dir...]" lines matched
+ * against the recipe's target (derived from the depsfile name); the
+ * first match narrows the watch scope. Each watch dir is then claimed
+ * with flock for the life of the invocation.
+ */
 
-    // Record atimes/mtimes but only after setting atime behind mtime
-    // for "relatime" reasons.
-    insist((p2 = calloc(sizeof(pathentry_s), 1)) != NULL, "calloc(sizeof(pathentry_s))");
-    p2->path = strdup(fpath);
-    p2->times1[0].tv_sec = -2L;
-    p2->times1[1].tv_sec = -1L;
-    p2->times2[0].tv_sec = sb->st_atime;
-    p2->times2[0].tv_nsec = sb->st_atim.tv_nsec;
-    p2->times2[1].tv_sec = sb->st_mtime;
-    p2->times2[1].tv_nsec = sb->st_mtim.tv_nsec;
-    if ((px = tfind((const void *)p2, &tree1, pathcmp))) {
-        p1 = *((pathentry_s **)px);
-        p2->times1[0].tv_sec = p1->times1[0].tv_sec;
-        p2->times1[0].tv_nsec = p1->times1[0].tv_nsec;
-        p2->times1[1].tv_sec = p1->times1[1].tv_sec;
-        p2->times1[1].tv_nsec = p1->times1[1].tv_nsec;
+static int infer_scope;     /* --infer-scope given */
+
+// Return the watch dirs mapped to this target, or NULL if no match.
+static char *
+scope_lookup(const char *mapfile, const char *target)
+{
+    FILE *mf;
+    char line[PATH_MAX * 2];
+    char *result = NULL;
+
+    if ((mf = fopen(mapfile, "r")) == NULL) {
+        fprintf(stderr, "%s: Warning: %s: %s\n",
+                prog, mapfile, strerror(errno));
+        return NULL;
     }
-    insist(tsearch((const void *)p2, &tree2, pathcmp) != NULL, "tsearch(&post)");
+    while (!result && fgets(line, sizeof(line), mf)) {
+        char *pattern, *dirs, *save;
 
-    return 0;
+        line[strcspn(line, "#\n")] = '\0';
+        if (!(pattern = strtok_r(line, " \t", &save)) ||
+                !(dirs = strtok_r(NULL, " \t", &save))) {
+            continue;
+        }
+        if (fnmatch(pattern, target, 0) == 0) {
+            result = strdup(dirs);
+        }
+    }
+    fclose(mf);
+    return result;
 }
 
-static int
-is_prereq(pathentry_s *p)
+// Derive the recipe's target from the depsfile name (-d $@.d) and look
+// it up in the scope map, if one was configured.
+static char *
+scope_from_map(const char *mapcli, const char *deps)
 {
-    // If mtime has moved it's a target 
-    // and if atime hasn't moved it's unused.
-    if (p->times2[1].tv_sec > p->times1[1].tv_sec) {
-        return 0;
-    } else if (p->times2[1].tv_sec == p->times1[1].tv_sec &&
-               p->times2[1].tv_nsec > p->times1[1].tv_nsec) {
-        return 0;
-    } else if (p->times2[0].tv_sec <= p->times1[0].tv_sec) {
-        return 0;
-    } else if (p->times2[0].tv_sec == p->times1[0].tv_sec &&
-               p->times2[0].tv_nsec <= p->times1[0].tv_nsec) {
-        return 0;
-    } else {
-        return 1;
+    const char *mapfile;
+    char *e, *target, *dirs;
+
+    mapfile = mapcli ? mapcli : getenv("PMASH_SCOPEMAP");
+    if (!mapfile || !deps) {
+        return NULL;
     }
+    target = strdup(deps);
+    if ((e = strrchr(target, '.'))) {
+        *e = '\0';
+    }
+    dirs = scope_lookup(mapfile, target);
+    free(target);
+    return dirs;
 }
 
-static void
-post_walk_1(const void *nodep, const VISIT which, const int depth)
+/*
+ * Derive a watch scope from the previous run's depsfile: the set of
+ * directories holding last time's target and prereqs is an excellent
+ * predictor of where this recipe will look again, and shrinks both
+ * scans from the whole tree to the relevant subtrees. This is opt-in
+ * (--infer-scope) because it's a bet: a prereq appearing in a
+ * directory the last run never touched would go unrecorded until the
+ * next full-scope run. Returns NULL - full scope - when there's no
+ * previous depsfile to learn from or any recorded path lives in ".".
+ */
+static char *
+scope_infer(const char *deps)
 {
-    pathentry_s *p = *((pathentry_s **)nodep);
+    FILE *df;
+    char tok[PATH_MAX];
+    char *dirs[64];
+    char *result = NULL;
+    size_t ndirs = 0, len = 0, i, j;
 
-    (void)depth;
-    if ((which != postorder && which != leaf) || !is_prereq(p)) {
-        return;
+    if ((df = fopen(deps, "r")) == NULL) {
+        return NULL;
     }
-    if (depsfile) {
-        if (prq_count++) {
-            fputs(" \\\n  ", fp);
-        } else {
-            const char *c, *e;
+    while (fscanf(df, "%4095s", tok) == 1) {
+        char *slash;
 
-            e = strrchr(depsfile, '.');
-            for (c = depsfile; c < e; c++) {
-                fputc(*c, fp);
+        if (!strcmp(tok, "\\")) {
+            continue;
+        }
+        tok[strcspn(tok, ":")] = '\0';
+        if (!tok[0]) {
+            continue;
+        }
+        if ((slash = strrchr(tok, '/')) == NULL) {
+            // A path directly in "." means no narrowing is possible.
+            while (ndirs) {
+                free(dirs[--ndirs]);
+            }
+            break;
+        }
+        *slash = '\0';
+        for (i = 0; i < ndirs && strcmp(dirs[i], tok); i++) {
+        }
+        if (i == ndirs) {
+            if (ndirs == sizeof(dirs) / sizeof(dirs[0])) {
+                // Too scattered to be a win - and truncating the set
+                // would silently drop real prereqs; keep full scope.
+                while (ndirs) {
+                    free(dirs[--ndirs]);
+                }
+                break;
+            }
+            dirs[ndirs++] = strdup(tok);
+        }
+    }
+    (void)fclose(df);
+    // Drop dirs nested under another collected dir, then join the rest.
+    for (i = 0; i < ndirs; i++) {
+        size_t l;
+
+        for (j = 0; j < ndirs; j++) {
+            l = strlen(dirs[j]);
+            if (i != j && dirs[j][0] &&
+                    !strncmp(dirs[i], dirs[j], l) && dirs[i][l] == '/') {
+                dirs[i][0] = '\0';
+                break;
+            }
+        }
+    }
+    for (i = 0; i < ndirs; i++) {
+        len += strlen(dirs[i]) + 1;
+    }
+    if (len) {
+        insist((result = malloc(len + 1)) != NULL, "malloc(scope)");
+        result[0] = '\0';
+        for (i = 0; i < ndirs; i++) {
+            if (dirs[i][0]) {
+                if (result[0]) {
+                    strcat(result, ",");
+                }
+                strcat(result, dirs[i]);
             }
-            fputs(": \\\n  ", fp);
         }
-        fputs(p->path, fp);
-    } else {
-        fputs(p->path, fp);
-        fputc('\n', fp);
     }
+    for (i = 0; i < ndirs; i++) {
+        free(dirs[i]);
+    }
+    return result;
 }
 
+/*
+ * Claim each watch dir for the duration of the run so overlapping
+ * parallel jobs serialize only against each other. Locking just the
+ * watch dir's own inode is not enough: "-W src" and "-W src/sub"
+ * overlap but lock different inodes. So the claim is hierarchical -
+ * a shared lock on every ancestor up to the walk root and an exclusive
+ * lock on the watch dir itself - which makes nested scopes collide on
+ * the ancestor while disjoint siblings still run concurrently. Locks
+ * are taken top-down for a consistent order and held until process
+ * exit, with CLOEXEC so the recipe's children (a spawned daemon, say)
+ * can't inherit and outlive them.
+ */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int fd, op;
+} scopelock_s;
+
+static scopelock_s *locks;
+static size_t nlocks, lockcap;
+
+// flock conflicts even between fds of the same process, so an inode
+// this invocation already holds (watch the aliases: ".", "src/..") is
+// never locked twice: a repeat is a no-op and an ancestor needing
+// promotion is upgraded on its existing fd.
 static void
-post_walk_2(const void *nodep, const VISIT which, const int depth)
+scope_lock_one(const char *path, int op)
 {
-    pathentry_s *p = *((pathentry_s **)nodep);
+    struct stat st;
+    size_t i;
+    int fd;
 
-    (void)depth;
-    if ((which != postorder && which != leaf) || !is_prereq(p)) {
-        return;
+    insist((fd = open(path, O_RDONLY|O_CLOEXEC)) != -1, path);
+    insist(fstat(fd, &st) != -1, path);
+    for (i = 0; i < nlocks; i++) {
+        if (locks[i].dev == st.st_dev && locks[i].ino == st.st_ino) {
+            (void)close(fd);
+            if (op == LOCK_EX && locks[i].op == LOCK_SH) {
+                insist(flock(locks[i].fd, LOCK_EX) != -1, path);
+                locks[i].op = LOCK_EX;
+            }
+            return;
+        }
     }
-    if (depsfile) {
-        fprintf(fp, "\n%s:\n", p->path);
+    insist(flock(fd, op) != -1, path);
+    if (nlocks == lockcap) {
+        lockcap = lockcap ? lockcap * 2 : 16;
+        insist((locks = realloc(locks, lockcap * sizeof(scopelock_s)))
+                != NULL, "realloc(locks)");
+    }
+    locks[nlocks].dev = st.st_dev;
+    locks[nlocks].ino = st.st_ino;
+    locks[nlocks].fd = fd;
+    locks[nlocks].op = op;
+    nlocks++;
+}
+
+static void
+scope_lock(const char *watchdirs)
+{
+    char *path;
+
+    for (path = strtok(strdup(watchdirs), ","); path; path = strtok(NULL, ",")) {
+        char *slash;
+        size_t l = strlen(path);
+
+        while (l > 1 && path[l - 1] == '/') {
+            path[--l] = '\0';
+        }
+        if (strcmp(path, ".") && path[0] != '/') {
+            scope_lock_one(".", LOCK_SH);
+        }
+        for (slash = strchr(path + (path[0] == '/'), '/'); slash;
+                slash = strchr(slash + 1, '/')) {
+            *slash = '\0';
+            scope_lock_one(path, LOCK_SH);
+            *slash = '/';
+        }
+        scope_lock_one(path, LOCK_EX);
     }
 }
 
 int
 main(int argc, char *argv[])
 {
-    char *path;
     char *p;
-    char *cmdstr = NULL, *watchdirs = ".";
+    char *cmdstr = NULL, *watchdirs = ".", *sockpath = NULL, *snapfile = NULL;
+    char *scopemap = NULL;
+    double tstamp, reftime = 0.0;
+    int wflag = 0;
     int eflag = 0;
     int rc = EXIT_SUCCESS;
 
     prog = strrchr(argv[0], '/');
     prog = prog ? prog + 1 : argv[0];
 
+    exclude_load();
+
+    // Never audit our own staging files (deps/json/snapshot temps and
+    // the atime probe all carry a ".<pid>.tmp" suffix).
+    insist(asprintf(&p, "*.%ld.tmp", (long)getpid()) != -1, "asprintf()");
+    exclude_add(p);
+
     while (1) {
         int c;
 
@@ -274,76 +3525,155 @@ main(int argc, char *argv[])
             case 'd':
                 depsfile = optarg;
                 break;
+            case 'D':
+                depsdb = optarg;
+                break;
             case 'e':
                 eflag++;
                 break;
+            case 'j':
+                jsonfile = optarg;
+                break;
+            case 'E':
+                if (!strcmp(optarg, "times")) {
+                    engine = ENGINE_TIMES;
+                } else if (!strcmp(optarg, "fanotify")) {
+                    engine = ENGINE_FANOTIFY;
+                } else if (!strcmp(optarg, "preload")) {
+                    engine = ENGINE_PRELOAD;
+                } else {
+                    die("unknown engine");
+                }
+                break;
+            case 'm':
+                scopemap = optarg;
+                break;
+            case 'O':
+                overlay = 1;
+                break;
+            case 'P':
+                prune_dirs = 1;
+                break;
+            case 's':
+                snapfile = optarg;
+                break;
+            case 'S':
+                sockpath = optarg;
+                break;
             case 'V':
                 verbosity++;
                 break;
             case 'W':
                 watchdirs = optarg;
+                wflag++;
+                break;
+            case 'X':
+                exclude_add(optarg);
+                break;
+            case 1:
+                show_stats++;
+                break;
+            case 2:
+                no_probe = 1;
+                break;
+            case 3:
+                verify_res = strtod(optarg, NULL);
+                break;
+            case 4:
+                dont_sync = 1;
+                break;
+            case 5:
+                restore_times = 1;
+                break;
+            case 6:
+                infer_scope = 1;
                 break;
         }
     }
 
+    if (!sockpath && (p = getenv("PMASH_SERVER"))) {
+        sockpath = p;
+    }
+
+    if (prune_dirs) {
+        // See the pruning comment: a by-path read inside an untouched
+        // directory leaves both of its parent's times alone, so -P can
+        // silently drop prereqs for recipes that open files that way.
+        fprintf(stderr, "%s: Warning: -P skips dirs whose times are "
+                "unchanged; by-path reads there won't be seen as prereqs\n",
+                prog);
+        record_dirs = 1;
+    }
+
+    // With -S but no command we *are* the server.
+    if (sockpath && !cmdstr) {
+        serve(sockpath, watchdirs);
+        return EXIT_SUCCESS;
+    }
+
     if (!cmdstr) {
         usage(EXIT_FAILURE);
     }
 
+    // Scope inference: prefer an explicit map entry, else learn from
+    // last time's depsfile, else stay with the full default scope.
+    if (infer_scope && !wflag && depsfile) {
+        char *dirs;
+
+        if ((dirs = scope_from_map(scopemap, depsfile)) == NULL) {
+            dirs = scope_infer(depsfile);
+        }
+        if (dirs) {
+            watchdirs = dirs;
+            wflag++;
+            if (verbosity) {
+                fprintf(stderr, "%s: inferred scope: %s\n", prog, watchdirs);
+            }
+        }
+    }
+
     /*
-     * It's hard to see how this could ever work in parallel builds
-     * so that use is disallowed.
+     * A whole-tree audit can't work in parallel builds, but a job
+     * whose scope is narrowed to declared directories can as long as
+     * overlapping jobs serialize. Unscoped -j use is still refused.
      */
     if ((p = getenv("MAKEFLAGS"))) {
         char *eq = strchr(p, '=');
         char *jf = strstr(p, " -j");
         if (jf && (!eq || jf < eq)) {
-            die("not supported in -j mode");
+            if (!wflag) {
+                char *dirs;
+
+                if ((dirs = scope_from_map(scopemap, depsfile)) == NULL) {
+                    die("not supported in -j mode without a watch scope");
+                }
+                watchdirs = dirs;
+            }
+            scope_lock(watchdirs);
         }
     }
 
-    if (depsfile) {
-        if ((fp = fopen(depsfile, "w")) == NULL) {
+    if (!sockpath) {
+        if (engine == ENGINE_TIMES) {
+            double t0 = monotime();
+
+            if (snapfile) {
+                record_dirs = 1;
+            }
+            if (!snapfile || snap_load(snapfile) == -1) {
+                pre_scan(watchdirs);
+            }
+            stats.pre_walk = monotime() - t0;
+        }
+
+        // Opened only after the baseline is in place: creating the
+        // staging file bumps its parent directory's mtime, which must
+        // not race the snapshot validation above.
+        if (deps_open() == -1) {
             fprintf(stderr, "%s: Warning: skipping %s: %s\n",
                     prog, depsfile, strerror(errno));
             return 0;
         }
-    } else {
-        fp = stdout;
-    }
-
-    for (path = strtok(strdup(watchdirs), ","); path; path = strtok(NULL, ",")) {
-        char *tmpf;
-        char buf[] = {"data\n"};
-        struct stat ostats, nstats;
-        struct timespec otimes[2] = {{-1, 0L}, {0, UTIME_OMIT}};
-        int fd;
-
-        /*
-         * Create, read, and remove a temp file to check that
-         * atimes are being updated.
-         */
-        insist((asprintf(&tmpf, "%s/audit.%ld.tmp", path,
-                        (long)getpid())) != -1, "asprintf()");
-        insist((fd = open(tmpf, O_CREAT|O_WRONLY|O_EXCL, 0644)) != -1, tmpf);
-        insist(write(fd, buf, strlen(buf)) != -1, tmpf);
-        insist(fstat(fd, &ostats) != -1, tmpf);
-        otimes[0].tv_sec = ostats.st_mtime - 1;
-        insist(futimens(fd, otimes) != -1, tmpf);
-        insist(close(fd) != -1, tmpf);
-        insist((fd = open(tmpf, O_RDONLY)) != -1, tmpf);
-        insist(read(fd, buf, sizeof(buf)) != -1, tmpf);
-        insist(close(fd) != -1, tmpf);
-        insist(stat(tmpf, &nstats) != -1, tmpf);
-        insist(unlink(tmpf) != -1, tmpf);
-        (void)free(tmpf);
-        if (nstats.st_atime < nstats.st_mtime ||
-                (nstats.st_atime == nstats.st_mtime &&
-                 nstats.st_atim.tv_nsec < nstats.st_mtim.tv_nsec)) {
-            die("atimes not updated here");
-        }
-
-        insist(nftw(path, nftw_pre_callback, NOPENFD, FTW_MOUNT) != -1, path);
     }
 
     if (verbosity || getenv("PMASH_VERBOSITY")) {
@@ -372,26 +3702,107 @@ main(int argc, char *argv[])
         insist(asprintf(&cmdstr, "set -e; %s", cmdstr) != -1, "asprintf()");
     }
 
-    if (system(cmdstr)) {
+    if (sockpath) {
+        return client(sockpath, cmdstr);
+    }
+
+    if (engine != ENGINE_TIMES) {
+        tstamp = monotime();
+        rc = (engine == ENGINE_FANOTIFY) ?
+            fanotify_audit(watchdirs, cmdstr) :
+            preload_audit(watchdirs, cmdstr);
+        stats.command = monotime() - tstamp;
+        if (rc >= 0) {
+            if (jsonfile) {
+                // The access table has no timestamps to classify, so
+                // the JSON database can't be synthesized faithfully.
+                fprintf(stderr, "%s: Warning: --json requires the "
+                        "timestamp engine, ignored with -E %s\n", prog,
+                        engine == ENGINE_FANOTIFY ? "fanotify" : "preload");
+            }
+            if (fp) {
+                emit_deps();
+                deps_close();
+            }
+            if (show_stats || verbosity > 1) {
+                stats_emit();
+            }
+            return rc;
+        }
+        fprintf(stderr, "%s: Warning: %s unavailable, "
+                "falling back to timestamp engine\n", prog,
+                engine == ENGINE_FANOTIFY ? "fanotify" : "preload");
+        rc = EXIT_SUCCESS;
+        pre_scan(watchdirs);
+    }
+
+    reftime = realtime();
+    tstamp = monotime();
+    if (overlay) {
+        int ov;
+
+        // See the overlay comment: reads through the overlay leave no
+        // atime trace for the timestamp diff to find.
+        fprintf(stderr, "%s: Warning: -O hides read atimes from the "
+                "timestamp engine; expect no prereqs (try -O -E preload)\n",
+                prog);
+        ov = overlay_run(watchdirs, cmdstr);
+        if (ov == -1) {
+            fprintf(stderr, "%s: Warning: overlay sandbox unavailable, "
+                    "running unconfined\n", prog);
+            ov = run_cmd(cmdstr);
+        }
+        if (ov) {
+            rc = EXIT_FAILURE;
+        }
+    } else if (run_cmd(cmdstr)) {
         rc = EXIT_FAILURE;
     }
+    stats.command = monotime() - tstamp;
 
     if (!fp) {
         return rc;
     }
 
-    for (path = strtok(strdup(watchdirs), ","); path; path = strtok(NULL, ",")) {
-        insist(nftw(path, nftw_post_callback, NOPENFD, FTW_MOUNT) != -1, path);
-    }
+    tstamp = monotime();
+    post_scan(watchdirs);
+    stats.post_walk = monotime() - tstamp;
 
-    twalk(tree2, post_walk_1);
-    fputc('\n', fp);
+    tstamp = monotime();
+    if (jsonfile) {
+        emit_json(cmdstr, reftime);
+    }
+    emit_deps();
+    deps_close();
     if (depsfile) {
-        twalk(tree2, post_walk_2);
+        dir_refresh(depsfile);
     }
+    if (jsonfile) {
+        dir_refresh(jsonfile);
+    }
+    stats.output = monotime() - tstamp;
 
-    if (depsfile) {
-        fclose(fp);
+    if (restore_times) {
+        if (snapfile) {
+            // Restored atimes land ahead of the primed mtimes the
+            // snapshot records, so the next run's relatime window
+            // would silently be closed.
+            fprintf(stderr, "%s: Warning: --restore-times defeats "
+                    "snapshot priming; skipping restore\n", prog);
+        } else {
+            restore_atimes();
+        }
+    }
+
+    // Fold this run's post-state into the baseline and persist it so
+    // the next run can pick up where we left off instead of re-walking.
+    if (snapfile && engine == ENGINE_TIMES) {
+        baseline_commit();
+        snap_save(snapfile);
+    }
+
+    if (show_stats || verbosity > 1) {
+        stats_emit();
     }
 
     return rc;
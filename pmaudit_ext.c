@@ -0,0 +1,94 @@
+/******************************************************************************
+ * Copyright (C) 2018-2020 David Boyce
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more detail.
+ *
+ * You may have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/*
+ * Thin CPython binding for libpmaudit. One function:
+ *
+ *     _pmaudit.scan(watchdir, excludes, prime)
+ *         -> [(path, atime, mtime, size), ...]
+ *
+ * where excludes is a comma-separated basename list and prime selects
+ * the pre-scan behavior (atime priming, symlinks skipped). The GIL is
+ * dropped for the duration of the walk. Built by "make pyext"; pmaudit
+ * falls back to its pure-Python loops when the module isn't importable
+ * so the extension stays strictly optional.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "libpmaudit.h"
+
+static PyObject *
+scan_py(PyObject *self, PyObject *args)
+{
+    const char *watchdir, *excludes;
+    int prime, rc;
+    pmaudit_ent_s *ents = NULL;
+    size_t n = 0, i;
+    PyObject *list;
+
+    (void)self;
+    if (!PyArg_ParseTuple(args, "ssp", &watchdir, &excludes, &prime)) {
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    rc = pmaudit_scan(watchdir, excludes, prime, &ents, &n);
+    Py_END_ALLOW_THREADS
+    if (rc == -1) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if ((list = PyList_New((Py_ssize_t)n)) == NULL) {
+        pmaudit_free(ents, n);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        PyObject *tup = Py_BuildValue("(sddL)", ents[i].path,
+                ents[i].atime, ents[i].mtime, ents[i].size);
+
+        if (tup == NULL) {
+            Py_DECREF(list);
+            pmaudit_free(ents, n);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t)i, tup);
+    }
+    pmaudit_free(ents, n);
+    return list;
+}
+
+static PyMethodDef pmaudit_methods[] = {
+    {"scan", scan_py, METH_VARARGS,
+     "scan(watchdir, excludes, prime) -> [(path, atime, mtime, size), ...]"},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef pmaudit_module = {
+    PyModuleDef_HEAD_INIT,
+    "_pmaudit",
+    "Native tree-scan engine for pmaudit (see libpmaudit.c).",
+    -1,
+    pmaudit_methods,
+    NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC
+PyInit__pmaudit(void)
+{
+    return PyModule_Create(&pmaudit_module);
+}
+
+// vim: ts=8:sw=4:tw=80:et: